@@ -1,12 +1,39 @@
 #include <vector>
 #include <array>
+#include <atomic>
+#include <memory>
+#include <fstream>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <xmmintrin.h>
+#include <emmintrin.h>
 #include <cmath>
 #include <iostream>
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <winsock2.h>
 #include <windows.h>
+#include <afunix.h>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+// Set to 1 to record scoped zones (frame, section, output) into per-thread
+// ring buffers and dump them as Chrome trace JSON on exit.
+#ifndef ENABLE_TRACING
+#define ENABLE_TRACING 0
+#endif
 
 using namespace std::chrono_literals;
 
@@ -15,12 +42,102 @@ const int CANVAS_WIDTH = 600;
 const int CANVAS_HEIGHT = 600;
 const int RECURSION_DEPTH = 3; // 0, 1, 2, 3, 5
 std::vector<DWORD> canvasBuffer;
+// What UpdateCanvas shows: canvasBuffer, except while the animation loop
+// renders the next frame into canvasBuffer and presents the last completed one.
+const std::vector<DWORD>* presentedBuffer = &canvasBuffer;
+std::vector<int> objectIdBuffer; // primary hit per pixel, -1 for background
 const float EPSILON = 0.001f;
+const float VIEWPORT_SIZE = 1.f;
+const float PROJECTION_PLANE_Z = 1.f;
+
+// Adaptive anti-aliasing: every pixel gets one sample, then only pixels on an
+// object-ID edge or with a high-contrast neighbour are re-traced with an
+// AA_GRID x AA_GRID stratified, jittered pattern.
+const bool ADAPTIVE_AA = true;
+const int AA_GRID = 4; // 2, 3, 4 (4, 9, 16 samples per edge pixel)
+const unsigned AA_CONTRAST_THRESHOLD = 24; // max per-channel difference
+std::vector<DWORD> aaSourceBuffer; // single-sample pass the edge detector reads
+std::atomic<int> aaEdgePixels{ 0 };
+
+// Progressive refinement: a 1/16-res preview (one sample per 4x4 block), then
+// the 2x2 and full-res levels, then extra jittered samples accumulated into
+// accumBuffer. Tiles are visited in Morton order and the canvas is presented
+// every PROGRESSIVE_PUBLISH_INTERVAL while the passes run.
+const bool PROGRESSIVE = false;
+const int PROGRESSIVE_TILE = 16; // must be a multiple of the coarsest level
+const int PROGRESSIVE_COARSEST = 4;
+const int PROGRESSIVE_SAMPLES = 16; // samples per pixel once converged
+const auto PROGRESSIVE_PUBLISH_INTERVAL = 33ms;
+const auto PROGRESSIVE_CHECKPOINT_INTERVAL = 30s; // with --checkpoint, between completed passes
+
+// Animation loop: nudges the camera every few frames instead of showing a
+// single still. With TEMPORAL_REPROJECTION the previous frame's primary hits
+// are reprojected into the new view and only holes, silhouettes and a
+// rotating 1/TEMPORAL_REFRESH_PERIOD of the pixels are traced again.
+const bool ANIMATE = false;
+const bool TEMPORAL_REPROJECTION = true;
+const int TEMPORAL_REFRESH_PERIOD = 16;
+const std::chrono::duration<double, std::milli> ANIMATION_FRAME_INTERVAL(1000.0 / 60);
+
+// Bobs the instances up and down while animating. The top-level BVH is refit
+// every frame and reoptimized in the background once its SAH cost has grown
+// by BVH_REBUILD_COST_RATIO; subtrees whose bounds grew by
+// BVH_TREELET_AREA_RATIO are the ones rebuilt. Moving geometry disables the
+// temporal reuse, which assumes a static scene. Trees with fewer than
+// BVH_PARALLEL_REFIT_NODES nodes are refit on the calling thread.
+const bool ANIMATE_INSTANCES = false;
+const float BVH_REBUILD_COST_RATIO = 1.3f;
+const float BVH_TREELET_AREA_RATIO = 1.5f;
+const size_t BVH_PARALLEL_REFIT_NODES = 1 << 14;
+
+// With LIGHT_TREE_MIN_LIGHTS or more point lights they are clustered into a
+// light tree. A shading point then evaluates a cut of at most LIGHT_CUT_SIZE
+// clusters, each standing in for its lights with one shadow ray, refining the
+// clusters that span the widest angle first. LIGHT_SAMPLING_STOCHASTIC
+// instead walks the tree LIGHT_SAMPLES times, picking children in proportion
+// to their estimated contribution. Both skip clusters entirely behind the
+// surface, whose lights SurfaceResponse would still give a specular term,
+// so neither converges to the full sum on glossy surfaces.
+const size_t LIGHT_TREE_MIN_LIGHTS = 16;
+const int LIGHT_CUT_SIZE = 8;
+const bool LIGHT_SAMPLING_STOCHASTIC = false;
+const int LIGHT_SAMPLES = 4;
+
+// Sphere and rectangle lights cast soft shadows from up to AREA_LIGHT_GRID^2
+// stratified shadow rays, fewer where the light is fully visible or hidden.
+const int AREA_LIGHT_GRID = 4; // even
+
+// Image textures are read tile by tile into a cache of at most
+// TEXTURE_CACHE_BYTES, whatever the size of the images.
+const size_t TEXTURE_CACHE_BYTES = size_t(256) << 20;
+
+// Meshes given with --stream stay on disk in chunks, at most
+// GEOMETRY_CACHE_BYTES of which are mapped at a time. Primary rays meet them
+// STREAM_BATCH_ROWS rows at a time, grouped by chunk.
+const size_t GEOMETRY_CACHE_BYTES = size_t(1) << 30;
+const int STREAM_BATCH_ROWS = 16;
+
+// Arrow keys move the camera during the animation loop. A frame whose camera
+// went stale is cancelled through renderGeneration and restarted at once.
+const float CAMERA_KEY_STEP = 0.05f;
+
+struct AccumPixel {
+    float b, g, r;
+    int samples;
+};
+std::vector<AccumPixel> accumBuffer;
 
 enum class LightType {
     AMBIENT = 0,
     POINT = 1,
     DIRECTIONAL = 2,
+    SPHERE = 3,
+    RECTANGLE = 4,
+};
+
+enum class TextureKind {
+    IMAGE = 0,
+    CHECKER = 1,
 };
 
 struct PointOnCanvas {
@@ -57,12 +174,278 @@ struct Sphere {
     Color color;
     int specular;
     float reflective; // [0.f, 1.f]
+    int texture = -1; // index into the scene's textures
+};
+
+// Infinite plane, the points p with dot(normal, p) == offset.
+struct Plane {
+    Vector3 normal; // unit length
+    float offset;
+    Color color;
+    int specular;
+    float reflective; // [0.f, 1.f]
+    int texture = -1; // index into the scene's textures
+};
+
+// Axis-aligned box.
+struct Box {
+    Vector3 min_corner;
+    Vector3 max_corner;
+    Color color;
+    int specular;
+    float reflective; // [0.f, 1.f]
+    int texture = -1; // index into the scene's textures
 };
 
 struct Light {
     LightType ltype;
     float intensity;
-    Vector3 position;
+    Vector3 position; // center of the area lights
+    float radius = 0.f; // SPHERE
+    Vector3 edge_u = { 0.f, 0.f, 0.f }; // RECTANGLE, spanning position +- edge_u / 2 +- edge_v / 2
+    Vector3 edge_v = { 0.f, 0.f, 0.f };
+};
+
+// Shading parameters, shared through Scene::materials by every object that
+// uses them.
+struct Material {
+    Color color;
+    int specular;
+    float reflective; // [0.f, 1.f]
+    int texture; // index into Scene::textures, -1 for none
+};
+
+// Texture as authored, repeating every `scale` world units: an image read
+// from a binary PPM file or a checkerboard of color_a and color_b cells.
+struct Texture {
+    TextureKind kind;
+    float scale;
+    std::string path; // IMAGE
+    Color color_a = { 255, 255, 255 }; // CHECKER
+    Color color_b = { 0, 0, 0 };
+};
+
+// One mip level of a tiled image texture.
+struct TextureLevel {
+    int width;
+    int height;
+    int tiles_x;
+    std::vector<uint32_t> tile_index; // file tile of each (tile_x, tile_y), row-major
+};
+
+// A texture ready for sampling. Image texels stay in the tiled cache file
+// and are read through the texture cache under this id.
+struct SampledTexture {
+    Texture source;
+    uint32_t id = 0;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    std::vector<TextureLevel> levels; // empty for procedural textures
+
+    explicit SampledTexture(const Texture& texture) : source(texture) {}
+    SampledTexture(const SampledTexture&) = delete;
+    SampledTexture& operator=(const SampledTexture&) = delete;
+    ~SampledTexture() {
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    }
+};
+
+// Sphere as the intersection loops see it.
+struct SphereShape {
+    Vector3 center;
+    float radius;
+    int material; // index into Scene::materials
+};
+
+struct Aabb {
+    Vector3 min_corner;
+    Vector3 max_corner;
+};
+
+// Children of an inner node are stored next to each other, the right one
+// at first + 1.
+struct BvhNode {
+    Aabb bounds;
+    int first; // leaf: first entry of its primitives, inner: left child
+    int count; // primitives in a leaf, 0 for inner nodes
+};
+
+struct Bvh {
+    std::vector<BvhNode> nodes; // nodes[0] is the root
+    std::vector<int> prim_indices; // leaves reference ranges of this
+};
+
+// Indexed triangle mesh as authored: three vertex indices per triangle.
+struct TriangleMesh {
+    std::vector<Vector3> vertices;
+    std::vector<int> indices;
+    Color color;
+    int specular;
+    float reflective; // [0.f, 1.f]
+    int texture = -1; // index into the scene's textures
+};
+
+// Four triangles laid out for one SSE intersection test, coordinates indexed
+// [axis][lane]. Unused lanes carry triangle -1.
+struct TrianglePacket {
+    alignas(16) float v0[3][4];
+    alignas(16) float v1[3][4];
+    alignas(16) float v2[3][4];
+    int triangle[4];
+};
+
+// A mesh ready for tracing. Each BVH leaf holds at most four triangles and
+// its `first` is the index of the packet holding them.
+struct MeshAccel {
+    Bvh bvh;
+    std::vector<TrianglePacket> packets;
+    std::vector<Vector3> vertices;
+    std::vector<int> indices;
+    int material;
+};
+
+// One spatial chunk of a streamed mesh: where its BVH nodes and triangle
+// packets lie in the chunk file. Leaves reference packets as in MeshAccel,
+// but packet lanes hold packet * 4 + lane instead of a triangle index.
+struct StreamChunk {
+    Aabb bounds;
+    uint64_t offset;
+    uint32_t node_count;
+    uint32_t packet_count;
+};
+
+// A chunk mapped into memory, unmapped once the geometry cache and every ray
+// tracing through it have let go.
+struct MappedChunk {
+    const void* view = nullptr;
+    const BvhNode* nodes = nullptr;
+    const TrianglePacket* packets = nullptr;
+    size_t bytes = 0;
+
+    ~MappedChunk() {
+        if (view != nullptr) UnmapViewOfFile(view);
+    }
+};
+
+// A mesh kept on disk. Only a BVH over its chunks is resident; the chunks
+// are mapped on demand through the geometry cache, which owns `resident`
+// and `position`.
+struct StreamedMesh {
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    std::vector<StreamChunk> chunks;
+    Bvh chunk_bvh; // one chunk per leaf
+    int material = 0;
+    std::vector<std::shared_ptr<const MappedChunk>> resident; // null while unmapped
+    std::vector<std::list<std::pair<StreamedMesh*, int>>::iterator> position; // in the cache's LRU list
+
+    StreamedMesh() = default;
+    StreamedMesh(const StreamedMesh&) = delete;
+    StreamedMesh& operator=(const StreamedMesh&) = delete;
+    ~StreamedMesh();
+};
+
+// Point lights clustered by a BVH over their positions. Per node it keeps the
+// summed intensity and the light that represents the cluster in a cut.
+struct LightTree {
+    std::vector<Light> lights;
+    Bvh bvh; // one light per leaf
+    std::vector<float> intensity;
+    std::vector<int> representative; // index into lights
+};
+
+// A reoptimized BVH handed back by a background rebuild.
+struct BvhRebuild {
+    Bvh bvh;
+    std::vector<float> built_area;
+    float cost;
+};
+
+// Spheres and meshes in their own local space, shared by every instance
+// placed from them.
+struct GeometrySet {
+    std::vector<Sphere> spheres;
+    std::vector<TriangleMesh> meshes;
+};
+
+// Bottom level of the two-level BVH: one per geometry set, built once.
+struct GeometryAccel {
+    std::vector<SphereShape> spheres;
+    Bvh sphere_bvh; // one sphere per leaf entry
+    std::vector<MeshAccel> meshes;
+    Aabb bounds;
+};
+
+// A geometry set placed in the world: p_world = transform * p_local + translation.
+// The transform may rotate, scale or shear but must be invertible.
+struct Instance {
+    int geometry;
+    Matrix3 transform;
+    Vector3 translation;
+};
+
+// Planes and boxes are stored as structure of arrays so their intersection
+// loops stream only the floats they test; shading goes through a material.
+struct PlaneArrays {
+    std::vector<float> normal_x, normal_y, normal_z, offset;
+    std::vector<int> material;
+};
+
+struct BoxArrays {
+    std::vector<float> min_x, min_y, min_z, max_x, max_y, max_z;
+    std::vector<int> material;
+};
+
+// Collects the distinct materials of a scene while it is built; objects with
+// identical shading share one entry.
+struct MaterialTable {
+    std::vector<Material> materials;
+    std::map<std::array<uint32_t, 6>, int> ids;
+
+    int Intern(const Color& color, int specular, float reflective, int texture) {
+        std::array<uint32_t, 6> key = { color.b, color.g, color.r, static_cast<uint32_t>(specular), 0,
+            static_cast<uint32_t>(texture) };
+        std::memcpy(&key[4], &reflective, sizeof(float));
+
+        auto inserted = ids.emplace(key, static_cast<int>(materials.size()));
+        if (inserted.second) {
+            materials.push_back({ color, specular, reflective, texture });
+        }
+        return inserted.first->second;
+    }
+};
+
+// Object IDs run over the spheres first, then the planes, the boxes, the
+// meshes (one ID per mesh), the instances (one ID per instance) and the
+// streamed meshes.
+struct Scene {
+    std::vector<Material> materials;
+    std::vector<SphereShape> spheres;
+    PlaneArrays planes;
+    BoxArrays boxes;
+    std::vector<MeshAccel> meshes;
+    std::vector<GeometryAccel> geometries;
+    std::vector<Instance> instances;
+    std::vector<Matrix3> instance_inverse; // world to local, per instance
+    Bvh instance_bvh; // top level, rebuilt by BuildTopLevel
+    std::vector<float> instance_built_area; // node areas when last (re)built
+    float instance_built_cost = 0;
+    std::future<BvhRebuild> instance_rebuild; // pending background reoptimization
+    std::vector<Light> lights; // point lights move to light_tree when there are many
+    LightTree light_tree;
+    std::vector<std::shared_ptr<const SampledTexture>> textures; // null where the image could not be read
+    std::vector<std::shared_ptr<StreamedMesh>> streamed;
+
+    int PlaneBase() const { return static_cast<int>(spheres.size()); }
+    int BoxBase() const { return PlaneBase() + static_cast<int>(planes.offset.size()); }
+    int MeshBase() const { return BoxBase() + static_cast<int>(boxes.min_x.size()); }
+    int InstanceBase() const { return MeshBase() + static_cast<int>(meshes.size()); }
+    int StreamBase() const { return InstanceBase() + static_cast<int>(instances.size()); }
+};
+
+// Primary hit reported by TraceRay when the caller asks for it.
+struct RayHit {
+    int object_id; // see Scene, -1 for background
+    float t;
 };
 
 // Scene setup
@@ -74,23 +457,170 @@ const Matrix3 CAMERA_ROTATION = {
     0.7071f, 0, 0.7071f
 };
 
+Vector3 cameraNudge = { 0.f, 0.f, 0.f }; // arrow-key offset, main thread only
+
 const std::vector<Sphere> SPHERES = {
     { {0, -1, 3}, 1, {0, 0, 255}, 500, 0.2f }, // red sphere
     { {2, 0, 4}, 1, {255, 0, 0}, 500, 0.3f }, // blue sphere
     { {-2, 0, 4 }, 1, { 0, 255, 0}, 10, 0.4f }, // green sphere
-    { {0, -5001, 0}, 5000, {0, 255, 255}, 1000, 0.5f }, // yellow sphere
     { {0, 2, 2}, 2, {0, 255, 255}, 1000, 0.5f } // yellow sphere
 };
 
+const std::vector<Plane> PLANES = {
+    { {0, 1, 0}, -1, {0, 255, 255}, 1000, 0.5f, 0 } // yellow checkered ground
+};
+
+const std::vector<Box> BOXES = {
+    { {-1.5f, -1, 5.5f}, {-0.5f, 0, 6.5f}, {255, 0, 255}, 100, 0.1f } // purple box
+};
+
+const std::vector<TriangleMesh> MESHES = {
+    { // orange pyramid
+        { {1.2f, -1, 2.2f}, {1.8f, -1, 2.2f}, {1.8f, -1, 2.8f}, {1.2f, -1, 2.8f}, {1.5f, -0.2f, 2.5f} },
+        { 0, 1, 4, 1, 2, 4, 2, 3, 4, 3, 0, 4 },
+        {0, 128, 255}, 50, 0.2f
+    }
+};
+
+// A small lamp post, placed several times below.
+const std::vector<GeometrySet> GEOMETRY_SETS = {
+    {
+        { { {0, 0.9f, 0}, 0.2f, {0, 255, 255}, 500, 0.3f } }, // yellow lamp
+        { { // post, a thin square pyramid
+            { {-0.1f, 0, -0.1f}, {0.1f, 0, -0.1f}, {0.1f, 0, 0.1f}, {-0.1f, 0, 0.1f}, {0, 0.8f, 0} },
+            { 0, 1, 4, 1, 2, 4, 2, 3, 4, 3, 0, 4 },
+            {64, 64, 64}, 10, 0.f
+        } }
+    }
+};
+
+const std::vector<Instance> INSTANCES = {
+    { 0, { 1, 0, 0, 0, 1, 0, 0, 0, 1 }, {-3.f, -1, 7.f} },
+    { 0, { 1.2f, 0, 0, 0, 1.2f, 0, 0, 0, 1.2f }, {-1.5f, -1, 8.5f} },
+    { 0, { 0.7071f, -0.7071f, 0, 0.7071f, 0.7071f, 0, 0, 0, 1 }, {0.5f, -0.6f, 9.f} }, // leaning
+    { 0, { 1, 0, 0, 0, 1.5f, 0, 0, 0, 1 }, {2.f, -1, 8.f} }
+};
+
+const std::vector<Texture> TEXTURES = {
+    { TextureKind::CHECKER, 1.f, "", {255, 255, 255}, {128, 128, 128} } // ground
+};
+
 // Lights setup
 const std::vector<Light> LIGHTS = {
     { LightType::AMBIENT, 0.2f, {INFINITY, INFINITY, INFINITY} },
-    { LightType::POINT, 0.6f, {2, 1, 0} },
+    { LightType::SPHERE, 0.6f, {2, 1, 0}, 0.25f },
     { LightType::DIRECTIONAL, 0.2f, {1, 4, 4} }
 };
 
 const Color BACKGROUND_COLOR = { 255, 255, 255 };
 
+// =============================================================================
+//                               Tracing zones
+// =============================================================================
+// Every thread owns one ring slot (main thread 0, render workers 1..N, the
+// background BVH rebuild TRACE_REBUILD_SLOT, the animation frame thread
+// TRACE_FRAME_SLOT, the Y4M pipeline TRACE_PIPELINE_SLOT) and is the only
+// writer to it, so recording a zone is a clock read plus a store. Threads
+// that never bind a slot, such as mesh parsing, server connection readers or
+// the checkpoint writer, record nothing: their zones are dropped rather than
+// racing the main thread on slot 0.
+// The slots are read back only by TraceDump after the workers were joined.
+// Open the resulting file in chrome://tracing or ui.perfetto.dev.
+
+const int TRACE_REBUILD_SLOT = 61;
+const int TRACE_FRAME_SLOT = 62;
+const int TRACE_PIPELINE_SLOT = 63;
+
+#if ENABLE_TRACING
+
+const int TRACE_MAX_THREADS = 64;
+const int TRACE_UNBOUND_SLOT = -1;
+const unsigned TRACE_RING_SIZE = 1 << 14; // events per slot, oldest overwritten
+
+struct TraceEvent {
+    const char* name;
+    long long begin_ns;
+    long long end_ns;
+};
+
+struct TraceRing {
+    std::array<TraceEvent, TRACE_RING_SIZE> events;
+    std::atomic<unsigned> head{ 0 };
+};
+
+std::unique_ptr<TraceRing[]> traceRings(new TraceRing[TRACE_MAX_THREADS]);
+const auto traceEpoch = std::chrono::steady_clock::now();
+thread_local int traceSlot = TRACE_UNBOUND_SLOT;
+
+long long TraceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+// Binds the calling thread to a ring slot. Two live threads must never share one.
+void TraceSetThread(int slot) {
+    traceSlot = slot % TRACE_MAX_THREADS;
+}
+
+struct TraceZone {
+    const char* name;
+    long long begin_ns;
+
+    explicit TraceZone(const char* zone_name) : name(zone_name), begin_ns(TraceNow()) {}
+
+    ~TraceZone() {
+        if (traceSlot == TRACE_UNBOUND_SLOT) {
+            return;
+        }
+        TraceRing& ring = traceRings[traceSlot];
+        unsigned head = ring.head.load(std::memory_order_relaxed);
+        ring.events[head % TRACE_RING_SIZE] = { name, begin_ns, TraceNow() };
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+};
+
+// Writes all recorded zones as Chrome trace "complete" events.
+void TraceDump(const char* path) {
+    std::ofstream out(path);
+    out << "{\"traceEvents\":[\n";
+    bool first = true;
+
+    for (int slot = 0; slot < TRACE_MAX_THREADS; slot++) {
+        const TraceRing& ring = traceRings[slot];
+        unsigned head = ring.head.load(std::memory_order_acquire);
+        if (head == 0) {
+            continue;
+        }
+
+        out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+            << slot << ",\"args\":{\"name\":\"" << (slot == 0 ? "main" : "worker ")
+            << (slot == 0 ? "" : std::to_string(slot)) << "\"}}";
+        first = false;
+
+        unsigned count = min(head, TRACE_RING_SIZE);
+        for (unsigned i = head - count; i != head; i++) {
+            const TraceEvent& e = ring.events[i % TRACE_RING_SIZE];
+            out << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << slot
+                << ",\"ts\":" << e.begin_ns / 1000.0 << ",\"dur\":" << (e.end_ns - e.begin_ns) / 1000.0 << "}";
+        }
+    }
+
+    out << "\n]}\n";
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+
+#else
+
+inline void TraceSetThread(int) {}
+inline void TraceDump(const char*) {}
+
+#define TRACE_ZONE(name) ((void)0)
+
+#endif
+
 void PutPixel(int x, int y, const Color& color) {
     int x_r = CANVAS_WIDTH / 2 + x;
     int y_r = CANVAS_HEIGHT / 2 - y;
@@ -101,7 +631,20 @@ void PutPixel(int x, int y, const Color& color) {
     }
 }
 
+// Maps canvas coordinates to an index into canvasBuffer, -1 when off-canvas.
+int CanvasOffset(int x, int y) {
+    int x_r = CANVAS_WIDTH / 2 + x;
+    int y_r = CANVAS_HEIGHT / 2 - y;
+
+    if (x_r >= 0 && x_r < CANVAS_WIDTH && y_r >= 0 && y_r < CANVAS_HEIGHT) {
+        return x_r + CANVAS_WIDTH * y_r;
+    }
+    return -1;
+}
+
 void UpdateCanvas(HWND hwnd, HDC hdc, int CANVAS_WIDTH, int CANVAS_HEIGHT) {
+    TRACE_ZONE("UpdateCanvas");
+
     BITMAPINFO bmi;
     ZeroMemory(&bmi, sizeof(BITMAPINFO));
 
@@ -117,7 +660,7 @@ void UpdateCanvas(HWND hwnd, HDC hdc, int CANVAS_WIDTH, int CANVAS_HEIGHT) {
     bmi.bmiHeader.biClrImportant = 0;
 
     SetDIBitsToDevice(hdc, 0, 0, CANVAS_WIDTH, CANVAS_HEIGHT, 0, 0, 0,
-        CANVAS_HEIGHT, canvasBuffer.data(), &bmi, DIB_RGB_COLORS);
+        CANVAS_HEIGHT, presentedBuffer->data(), &bmi, DIB_RGB_COLORS);
 }
 
 
@@ -148,6 +691,10 @@ Vector3 Add(const Vector3& v1, const Vector3& v2) {
     return { v1.x + v2.x, v1.y + v2.y, v1.z + v2.z };
 }
 
+Vector3 CrossProduct(const Vector3& v1, const Vector3& v2) {
+    return { v1.y * v2.z - v1.z * v2.y, v1.z * v2.x - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x };
+}
+
 // =============================================================================
 //                            Color operating routines                
 // =============================================================================
@@ -186,138 +733,5108 @@ Vector3 MultiplyMV(const Matrix3& mat, const Vector3& vec) {
     return result;
 }
 
+// Multiplies the transpose of a matrix and a vector, i.e. the inverse
+// for a rotation matrix.
+Vector3 MultiplyMTV(const Matrix3& mat, const Vector3& vec) {
+    Vector3 result = { 0.f, 0.f, 0.f };
+
+    result.x = DotProduct(mat.col0, vec);
+    result.y = DotProduct(mat.col1, vec);
+    result.z = DotProduct(mat.col2, vec);
+
+    return result;
+}
+
+// Inverse of an invertible matrix, via its adjugate.
+Matrix3 Inverse(const Matrix3& mat) {
+    const std::array<float, 9>& m = mat.matrix_buf;
+    float c0 = m[4] * m[8] - m[5] * m[7];
+    float c1 = m[5] * m[6] - m[3] * m[8];
+    float c2 = m[3] * m[7] - m[4] * m[6];
+    float inv_det = 1.f / (m[0] * c0 + m[1] * c1 + m[2] * c2);
+
+    return { {
+        c0 * inv_det, (m[2] * m[7] - m[1] * m[8]) * inv_det, (m[1] * m[5] - m[2] * m[4]) * inv_det,
+        c1 * inv_det, (m[0] * m[8] - m[2] * m[6]) * inv_det, (m[2] * m[3] - m[0] * m[5]) * inv_det,
+        c2 * inv_det, (m[1] * m[6] - m[0] * m[7]) * inv_det, (m[0] * m[4] - m[1] * m[3]) * inv_det
+    } };
+}
+
 
 Vector3 ReflectRayDirection(const Vector3& ray, const Vector3& normal) {
     return Subtract(Multiply(2 * DotProduct(ray, normal), normal), ray);
 }
 
+// =============================================================================
+//                            Frame cancellation
+// =============================================================================
 
-void Interpolate(int i0, int d0, int i1, int d1, std::vector<float>& ds) {
-    if (i0 == i1) {
-        ds.push_back(static_cast<float>(d0));
+// Bumping the generation cancels every frame started under an older one.
+// Workers poll it once per tile (a scanline for the section renderers), so a
+// stale frame is abandoned within one tile's worth of work.
+std::atomic<unsigned> renderGeneration{ 0 };
+
+bool FrameCancelled(unsigned generation) {
+    return renderGeneration.load(std::memory_order_relaxed) != generation;
+}
+
+// =============================================================================
+//                           Counter-based random numbers
+// =============================================================================
+// Every random number is a pure function of what it is for: Philox4x32-10
+// maps a counter (pixel, sample, ...) and a key (frame, stream) to four
+// independent 32-bit values. No generator state is carried between calls,
+// so an image is bit-identical whatever the thread count, section split,
+// tile order or node that renders each pixel.
+
+enum RngStream : uint32_t {
+    RNG_STREAM_PIXEL = 1, // sub-pixel jitter for AA and progressive samples
+    RNG_STREAM_LIGHT = 2, // stochastic light tree traversal
+    RNG_STREAM_AREA_LIGHT = 3 // soft shadow rays
+};
+
+// Animation frame the samples belong to, so successive frames decorrelate.
+// Only written between frames.
+uint32_t samplingFrame = 0;
+
+std::array<uint32_t, 4> Philox4x32(std::array<uint32_t, 4> counter, std::array<uint32_t, 2> key) {
+    for (int round = 0; round < 10; round++) {
+        uint64_t product0 = static_cast<uint64_t>(0xD2511F53u) * counter[0];
+        uint64_t product1 = static_cast<uint64_t>(0xCD9E8D57u) * counter[2];
+        counter = {
+            static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key[0],
+            static_cast<uint32_t>(product1),
+            static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key[1],
+            static_cast<uint32_t>(product0)
+        };
+        key[0] += 0x9E3779B9u;
+        key[1] += 0xBB67AE85u;
     }
+    return counter;
+}
 
-    float a = static_cast<float>(d1 - d0) / (i1 - i0);
-    float d = static_cast<float>(d0);
+// Top 24 bits to [0, 1).
+float UnitFloat(uint32_t bits) {
+    return (bits >> 8) * (1.f / 16777216.f);
+}
 
-    for (int i = i0; i <= i1; i++) {
-        ds.push_back(d);
-        d += a;
+// Four uniform numbers in [0, 1) for one sample of one pixel.
+std::array<float, 4> PixelRandom(int x, int y, int sample) {
+    std::array<uint32_t, 4> bits = Philox4x32(
+        { static_cast<uint32_t>(x), static_cast<uint32_t>(y), static_cast<uint32_t>(sample), 0 },
+        { samplingFrame, RNG_STREAM_PIXEL });
+    return { UnitFloat(bits[0]), UnitFloat(bits[1]), UnitFloat(bits[2]), UnitFloat(bits[3]) };
+}
+
+// =============================================================================
+//                               Mesh loading
+// =============================================================================
+// OBJ and PLY files are memory-mapped and split into chunks that are parsed
+// on separate threads. The result is cached next to the source file in a
+// flat binary form that reloads with a single copy.
+
+const char* const MESH_CACHE_EXTENSION = ".rtmesh";
+const uint32_t MESH_CACHE_VERSION = 1;
+
+// Cache files (meshes, chunk files, textures) are written under a name
+// private to this process and renamed over the cache when complete, so
+// processes building the same cache at once, such as --distribute workers,
+// never map one that is half written.
+std::string TempCachePath(const std::string& cache_path) {
+    return cache_path + "." + std::to_string(GetCurrentProcessId()) + ".tmp";
+}
+
+// Closes a cache written to TempCachePath(cache_path) and moves it into
+// place. If the rename fails, say because another process has the cache
+// mapped, that process's copy stays. Returns whether the write succeeded.
+bool CommitCacheFile(std::ofstream& out, const std::string& cache_path) {
+    out.close();
+    bool written = !out.fail();
+    std::error_code error;
+    if (written) {
+        std::filesystem::rename(TempCachePath(cache_path), cache_path, error);
     }
+    if (!written || error) {
+        std::filesystem::remove(TempCachePath(cache_path), error);
+    }
+    return written;
 }
 
-void DrawLine(const PointOnCanvas& p0, const PointOnCanvas& p1, const Color& color) {
-    int dx = p1.x - p0.x;
-    int dy = p1.y - p0.y;
-    std::vector<float> ds;
+// Read-only view of a whole file through a Win32 file mapping.
+struct MappedFile {
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    const char* data = nullptr;
+    size_t size = 0;
 
-    if (std::abs(dx) > std::abs(dy)) {
-        // The line is horizontal-ish. Make sure it's left to right.
-        if (dx < 0) {
-            auto swap = p0;
-            const_cast<PointOnCanvas&>(p0) = p1;
-            const_cast<PointOnCanvas&>(p1) = swap;
+    bool Open(const std::string& path) {
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
         }
 
-        // Compute the Y values and draw.
-        Interpolate(p0.x, p0.y, p1.x, p1.y, ds);
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+            return false; // empty files cannot be mapped
+        }
+        size = static_cast<size_t>(file_size.QuadPart);
 
-        for (int x = p0.x; x <= p1.x; x++) {
-            PutPixel(x, static_cast<int>(ds[(x - p0.x) | 0]), color);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr) {
+            return false;
         }
+        data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        return data != nullptr;
     }
-    else {
-        // The line is verical-ish. Make sure it's bottom to top.
-        if (dy < 0) {
-            auto swap = p0;
-            const_cast<PointOnCanvas&>(p0) = p1;
-            const_cast<PointOnCanvas&>(p1) = swap;
-        }
 
-        // Compute the X values and draw.
-        Interpolate(p0.y, p0.x, p1.y, p1.x, ds);
+    ~MappedFile() {
+        if (data != nullptr) UnmapViewOfFile(data);
+        if (mapping != nullptr) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    }
+};
 
-        for (int y = p0.y; y <= p1.y; y++) {
-            PutPixel(static_cast<int>(ds[(y - p0.y) | 0]), y, color);
-        }
+const char* SkipSpaces(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
     }
+    return p;
 }
 
-void DrawWireframeTriangle(const PointOnCanvas& p0, const PointOnCanvas& p1, const PointOnCanvas& p2, const Color& color) {
-    DrawLine(p0, p1, color);
-    DrawLine(p1, p2, color);
-    DrawLine(p0, p2, color);
+const char* SkipToken(const char* p, const char* end) {
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+        p++;
+    }
+    return p;
 }
 
+const char* LineEnd(const char* p, const char* end) {
+    const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    return line_end != nullptr ? line_end : end;
+}
 
-void DrawFilledTriangle(const PointOnCanvas& p0, const PointOnCanvas& p1, const PointOnCanvas& p2, const Color& color) {
-    // Sort the points from bottom to top.
-    if (p1.y < p0.y) {
-        auto swap = p0;
-        const_cast<PointOnCanvas&>(p0) = p1;
-        const_cast<PointOnCanvas&>(p1) = swap;
+// from_chars never reads past end, so the mapped file needs no terminator.
+bool ParseFloat(const char*& p, const char* end, float& value) {
+    p = SkipSpaces(p, end);
+    auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc()) {
+        return false;
     }
-    if (p2.y < p0.y) {
-        auto swap = p0;
-        const_cast<PointOnCanvas&>(p0) = p2;
-        const_cast<PointOnCanvas&>(p2) = swap;
+    p = result.ptr;
+    return true;
+}
+
+bool ParseInt(const char*& p, const char* end, long long& value) {
+    p = SkipSpaces(p, end);
+    auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc()) {
+        return false;
     }
-    if (p2.y < p1.y) {
-        auto swap = p1;
-        const_cast<PointOnCanvas&>(p1) = p2;
-        const_cast<PointOnCanvas&>(p2) = swap;
+    p = result.ptr;
+    return true;
+}
+
+// Splits [data, data + size) into up to `parts` ranges that end on a newline.
+std::vector<std::pair<const char*, const char*>> SplitAtLines(const char* data, size_t size, unsigned parts) {
+    std::vector<std::pair<const char*, const char*>> ranges;
+    const char* end = data + size;
+    const char* begin = data;
+
+    for (unsigned i = 1; i <= parts && begin < end; i++) {
+        const char* split = i == parts ? end : data + size * i / parts;
+        if (split < begin) {
+            continue;
+        }
+        split = split < end ? LineEnd(split, end) : end;
+        if (split < end) {
+            split++; // keep the newline with its line
+        }
+        ranges.push_back({ begin, split });
+        begin = split;
     }
+    return ranges;
+}
 
-    std::vector<float> x01;
-    std::vector<float> x12;
-    std::vector<float> x02;
+struct ObjChunk {
+    std::vector<Vector3> vertices;
+    std::vector<int> indices; // global, except the entries in relative_slots
+    std::vector<size_t> relative_slots; // negative OBJ indices, chunk-local
+    bool ok = true;
+};
 
-    // Compute X coordinates of the edges.
-    Interpolate(p0.y, p0.x, p1.y, p1.x, x01);
-    Interpolate(p1.y, p1.x, p2.y, p2.x, x12);
-    Interpolate(p0.y, p0.x, p2.y, p2.x, x01);
+// Parses the "v" and "f" records of one chunk. Polygons are fanned into
+// triangles; texture and normal references are ignored.
+void ParseObjChunk(const char* p, const char* end, ObjChunk& chunk) {
+    std::vector<long long> polygon;
+
+    while (p < end) {
+        const char* line_end = LineEnd(p, end);
+        p = SkipSpaces(p, line_end);
+
+        if (line_end - p > 1 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            Vector3 v;
+            if (!ParseFloat(p, line_end, v.x) || !ParseFloat(p, line_end, v.y) || !ParseFloat(p, line_end, v.z)) {
+                chunk.ok = false;
+                return;
+            }
+            chunk.vertices.push_back(v);
+        }
+        else if (line_end - p > 1 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            polygon.clear();
+
+            long long index;
+            while (ParseInt(p, line_end, index)) {
+                if (index == 0) {
+                    chunk.ok = false;
+                    return;
+                }
+                polygon.push_back(index);
+                p = SkipToken(p, line_end); // "/vt/vn"
+            }
+
+            for (size_t k = 1; k + 1 < polygon.size(); k++) {
+                for (long long corner : { polygon[0], polygon[k], polygon[k + 1] }) {
+                    if (corner > 0) {
+                        chunk.indices.push_back(static_cast<int>(corner - 1));
+                    }
+                    else {
+                        chunk.relative_slots.push_back(chunk.indices.size());
+                        chunk.indices.push_back(static_cast<int>(chunk.vertices.size() + corner));
+                    }
+                }
+            }
+        }
+
+        p = line_end + 1;
+    }
+}
+
+bool ParseObj(const MappedFile& file, unsigned num_threads, TriangleMesh& mesh) {
+    auto ranges = SplitAtLines(file.data, file.size, max(1u, num_threads));
+    std::vector<ObjChunk> chunks(ranges.size());
+    std::vector<std::thread> workers;
+
+    for (size_t i = 0; i < ranges.size(); i++) {
+        workers.emplace_back([&, i] {
+            ParseObjChunk(ranges[i].first, ranges[i].second, chunks[i]);
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    size_t vertex_base = 0;
+    for (ObjChunk& chunk : chunks) {
+        if (!chunk.ok) {
+            return false;
+        }
+        for (size_t slot : chunk.relative_slots) {
+            chunk.indices[slot] += static_cast<int>(vertex_base);
+        }
+        mesh.vertices.insert(mesh.vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+        mesh.indices.insert(mesh.indices.end(), chunk.indices.begin(), chunk.indices.end());
+        vertex_base += chunk.vertices.size();
+    }
+    return true;
+}
+
+int PlyTypeSize(const std::string& type) {
+    if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") return 1;
+    if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") return 2;
+    if (type == "int" || type == "uint" || type == "int32" || type == "uint32" ||
+        type == "float" || type == "float32") return 4;
+    if (type == "double" || type == "float64") return 8;
+    return 0;
+}
+
+// Reads one little-endian binary PLY scalar.
+double ReadPlyScalar(const char* p, const std::string& type) {
+    if (type == "float" || type == "float32") { float v; std::memcpy(&v, p, 4); return v; }
+    if (type == "double" || type == "float64") { double v; std::memcpy(&v, p, 8); return v; }
+    if (type == "char" || type == "int8") return static_cast<signed char>(*p);
+    if (type == "uchar" || type == "uint8") return static_cast<unsigned char>(*p);
+    if (type == "short" || type == "int16") { int16_t v; std::memcpy(&v, p, 2); return v; }
+    if (type == "ushort" || type == "uint16") { uint16_t v; std::memcpy(&v, p, 2); return v; }
+    if (type == "int" || type == "int32") { int32_t v; std::memcpy(&v, p, 4); return v; }
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+struct PlyProperty {
+    std::string name;
+    std::string type; // element type for lists
+    std::string count_type; // empty unless this is a list
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+};
+
+// Supports ascii and binary_little_endian files with "vertex" (x, y, z) and
+// "face" (vertex_indices list) elements. Binary vertex records are decoded in
+// parallel; faces have variable size and are walked sequentially.
+bool ParsePly(const MappedFile& file, unsigned num_threads, TriangleMesh& mesh) {
+    const char* p = file.data;
+    const char* end = file.data + file.size;
+    std::vector<PlyElement> elements;
+    bool binary = false;
+
+    for (bool first = true;; first = false) {
+        if (p >= end) {
+            return false;
+        }
+        const char* line_end = LineEnd(p, end);
+        std::string line(p, line_end);
+        p = line_end < end ? line_end + 1 : end;
+
+        std::vector<std::string> words;
+        for (size_t pos = 0; pos < line.size();) {
+            size_t next = line.find_first_of(" \t\r", pos);
+            if (next == std::string::npos) next = line.size();
+            if (next > pos) words.push_back(line.substr(pos, next - pos));
+            pos = next + 1;
+        }
+
+        if (first) {
+            if (words.empty() || words[0] != "ply") return false;
+        }
+        else if (words.empty() || words[0] == "comment" || words[0] == "obj_info") {
+            continue;
+        }
+        else if (words[0] == "format" && words.size() >= 2) {
+            if (words[1] == "binary_little_endian") binary = true;
+            else if (words[1] != "ascii") return false;
+        }
+        else if (words[0] == "element" && words.size() == 3) {
+            const char* count_end = words[2].data() + words[2].size();
+            unsigned long long count;
+            auto result = std::from_chars(words[2].data(), count_end, count);
+            if (result.ec != std::errc() || result.ptr != count_end) return false;
+            elements.push_back({ words[1], static_cast<size_t>(count), {} });
+        }
+        else if (words[0] == "property" && !elements.empty()) {
+            // Unknown types would leave the record layout unknown.
+            if (words.size() == 5 && words[1] == "list") {
+                if (PlyTypeSize(words[2]) == 0 || PlyTypeSize(words[3]) == 0) return false;
+                elements.back().properties.push_back({ words[4], words[3], words[2] });
+            }
+            else if (words.size() == 3) {
+                if (PlyTypeSize(words[1]) == 0) return false;
+                elements.back().properties.push_back({ words[2], words[1], "" });
+            }
+            else {
+                return false;
+            }
+        }
+        else if (words[0] == "end_header") {
+            break;
+        }
+    }
+
+    for (const PlyElement& element : elements) {
+        bool is_vertex = element.name == "vertex";
+        bool is_face = element.name == "face";
+        size_t first_vertex = mesh.vertices.size();
+
+        // Binary vertices without lists have a fixed stride, decode them in parallel.
+        int stride = 0;
+        int offsets[3] = { -1, -1, -1 };
+        std::string types[3];
+        for (const PlyProperty& property : element.properties) {
+            if (!property.count_type.empty()) {
+                stride = -1;
+                break;
+            }
+            int axis = property.name == "x" ? 0 : (property.name == "y" ? 1 : (property.name == "z" ? 2 : -1));
+            if (axis >= 0) {
+                offsets[axis] = stride;
+                types[axis] = property.type;
+            }
+            stride += PlyTypeSize(property.type);
+        }
+
+        if (binary && stride > 0) {
+            if (element.count > static_cast<size_t>(end - p) / stride) {
+                return false;
+            }
+            if (is_vertex) {
+                if (offsets[0] < 0 || offsets[1] < 0 || offsets[2] < 0) {
+                    return false;
+                }
+                mesh.vertices.resize(first_vertex + element.count);
+                std::vector<std::thread> workers;
+                unsigned parts = max(1u, num_threads);
+                for (unsigned part = 0; part < parts; part++) {
+                    workers.emplace_back([&, part] {
+                        for (size_t i = element.count * part / parts; i < element.count * (part + 1) / parts; i++) {
+                            const char* record = p + i * stride;
+                            mesh.vertices[first_vertex + i] = {
+                                static_cast<float>(ReadPlyScalar(record + offsets[0], types[0])),
+                                static_cast<float>(ReadPlyScalar(record + offsets[1], types[1])),
+                                static_cast<float>(ReadPlyScalar(record + offsets[2], types[2]))
+                            };
+                        }
+                    });
+                }
+                for (auto& worker : workers) {
+                    worker.join();
+                }
+            }
+            p += element.count * stride;
+            continue;
+        }
+
+        std::vector<long long> polygon;
+        for (size_t i = 0; i < element.count; i++) {
+            if (p >= end) {
+                return false; // fewer records than the header promised
+            }
+            Vector3 v = { 0.f, 0.f, 0.f };
+            polygon.clear();
+            const char* line_end = binary ? end : LineEnd(p, end);
+
+            for (const PlyProperty& property : element.properties) {
+                if (property.count_type.empty()) {
+                    double value;
+                    if (binary) {
+                        int size = PlyTypeSize(property.type);
+                        if (size == 0 || end - p < size) return false;
+                        value = ReadPlyScalar(p, property.type);
+                        p += size;
+                    }
+                    else {
+                        float parsed;
+                        if (!ParseFloat(p, line_end, parsed)) return false;
+                        value = parsed;
+                    }
+                    if (property.name == "x") v.x = static_cast<float>(value);
+                    if (property.name == "y") v.y = static_cast<float>(value);
+                    if (property.name == "z") v.z = static_cast<float>(value);
+                    continue;
+                }
+
+                long long count;
+                if (binary) {
+                    int size = PlyTypeSize(property.count_type);
+                    if (size == 0 || end - p < size) return false;
+                    count = static_cast<long long>(ReadPlyScalar(p, property.count_type));
+                    p += size;
+                }
+                else if (!ParseInt(p, line_end, count)) {
+                    return false;
+                }
+
+                bool indices = property.name == "vertex_indices" || property.name == "vertex_index";
+                for (long long k = 0; k < count; k++) {
+                    long long index;
+                    if (binary) {
+                        int size = PlyTypeSize(property.type);
+                        if (size == 0 || end - p < size) return false;
+                        index = static_cast<long long>(ReadPlyScalar(p, property.type));
+                        p += size;
+                    }
+                    else if (!ParseInt(p, line_end, index)) {
+                        return false;
+                    }
+                    if (indices) {
+                        polygon.push_back(index);
+                    }
+                }
+            }
+
+            if (!binary) {
+                p = line_end < end ? line_end + 1 : end;
+            }
+            if (is_vertex) {
+                mesh.vertices.push_back(v);
+            }
+            if (is_face) {
+                for (size_t k = 1; k + 1 < polygon.size(); k++) {
+                    mesh.indices.push_back(static_cast<int>(polygon[0]));
+                    mesh.indices.push_back(static_cast<int>(polygon[k]));
+                    mesh.indices.push_back(static_cast<int>(polygon[k + 1]));
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+// Merges vertices with bit-identical positions and remaps the indices.
+void DeduplicateVertices(TriangleMesh& mesh) {
+    struct PositionHash {
+        size_t operator()(const std::array<uint32_t, 3>& key) const {
+            uint64_t h = key[0] * 0x9E3779B97F4A7C15ull;
+            h ^= (h >> 29) ^ key[1] * 0xBF58476D1CE4E5B9ull;
+            h ^= (h >> 32) ^ key[2] * 0x94D049BB133111EBull;
+            return static_cast<size_t>(h ^ (h >> 31));
+        }
+    };
+
+    std::unordered_map<std::array<uint32_t, 3>, int, PositionHash> unique;
+    unique.reserve(mesh.vertices.size());
+    std::vector<int> remap(mesh.vertices.size());
+    std::vector<Vector3> vertices;
+
+    for (size_t i = 0; i < mesh.vertices.size(); i++) {
+        std::array<uint32_t, 3> key;
+        std::memcpy(key.data(), &mesh.vertices[i], sizeof(key));
+        auto inserted = unique.emplace(key, static_cast<int>(vertices.size()));
+        if (inserted.second) {
+            vertices.push_back(mesh.vertices[i]);
+        }
+        remap[i] = inserted.first->second;
+    }
+
+    for (int& index : mesh.indices) {
+        index = remap[index];
+    }
+    mesh.vertices.swap(vertices);
+}
+
+struct MeshCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_size;
+    int64_t source_time;
+    uint64_t vertex_count;
+    uint64_t index_count;
+};
+
+// True when every index names one of the mesh's vertices.
+bool IndicesInRange(const TriangleMesh& mesh) {
+    for (int index : mesh.indices) {
+        if (index < 0 || static_cast<size_t>(index) >= mesh.vertices.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The cache is checked like a freshly parsed mesh, so a corrupt file is
+// parsed again rather than trusted.
+bool ReadMeshCache(const std::string& cache_path, uint64_t source_size, int64_t source_time,
+    TriangleMesh& mesh) {
+    MappedFile cache;
+    if (!cache.Open(cache_path) || cache.size < sizeof(MeshCacheHeader)) {
+        return false;
+    }
+
+    MeshCacheHeader header;
+    std::memcpy(&header, cache.data, sizeof(header));
+    if (std::memcmp(header.magic, "RTMC", 4) != 0 || header.version != MESH_CACHE_VERSION ||
+        header.source_size != source_size || header.source_time != source_time ||
+        header.vertex_count > cache.size || header.index_count > cache.size ||
+        cache.size != sizeof(header) + header.vertex_count * sizeof(Vector3) + header.index_count * sizeof(int)) {
+        return false;
+    }
+
+    const char* payload = cache.data + sizeof(header);
+    mesh.vertices.resize(header.vertex_count);
+    mesh.indices.resize(header.index_count);
+    std::memcpy(mesh.vertices.data(), payload, header.vertex_count * sizeof(Vector3));
+    std::memcpy(mesh.indices.data(), payload + header.vertex_count * sizeof(Vector3), header.index_count * sizeof(int));
+    return IndicesInRange(mesh);
+}
+
+void WriteMeshCache(const std::string& cache_path, uint64_t source_size, int64_t source_time,
+    const TriangleMesh& mesh) {
+    MeshCacheHeader header = { { 'R', 'T', 'M', 'C' }, MESH_CACHE_VERSION, source_size, source_time,
+        mesh.vertices.size(), mesh.indices.size() };
+
+    std::ofstream out(TempCachePath(cache_path), std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(mesh.vertices.data()), mesh.vertices.size() * sizeof(Vector3));
+    out.write(reinterpret_cast<const char*>(mesh.indices.data()), mesh.indices.size() * sizeof(int));
+    CommitCacheFile(out, cache_path);
+}
+
+// Loads the positions and triangles of an .obj or .ply file into mesh,
+// leaving its material untouched. Returns false when the file cannot be
+// read or is malformed.
+bool LoadMesh(const std::string& path, unsigned num_threads, TriangleMesh& mesh) {
+    TRACE_ZONE("LoadMesh");
+
+    std::error_code ec;
+    uint64_t source_size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return false;
+    }
+    int64_t source_time = static_cast<int64_t>(
+        std::filesystem::last_write_time(path, ec).time_since_epoch().count());
+
+    std::string cache_path = path + MESH_CACHE_EXTENSION;
+    if (ReadMeshCache(cache_path, source_size, source_time, mesh)) {
+        return true;
+    }
+
+    MappedFile file;
+    if (!file.Open(path)) {
+        return false;
+    }
+
+    std::string extension = std::filesystem::path(path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+        [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+
+    mesh.vertices.clear();
+    mesh.indices.clear();
+    bool parsed = extension == ".obj" ? ParseObj(file, num_threads, mesh)
+        : extension == ".ply" ? ParsePly(file, num_threads, mesh)
+        : false;
+    if (!parsed || !IndicesInRange(mesh)) {
+        return false;
+    }
+
+    DeduplicateVertices(mesh);
+    WriteMeshCache(cache_path, source_size, source_time, mesh);
+    return true;
+}
+
+// =============================================================================
+//                                 Textures
+// =============================================================================
+// An image texture is converted once into a mip chain cached next to the
+// source file. Every level is cut into TEXTURE_TILE x TEXTURE_TILE tiles
+// stored in Morton order, and the texels of a tile are in Morton order too,
+// so a bilinear footprint usually lies in one tile and often in one aligned
+// 16-byte quad. Tiles are read on demand into a cache bounded by
+// TEXTURE_CACHE_BYTES; only the tiles rays actually touch become resident.
+
+const char* const TEXTURE_CACHE_EXTENSION = ".rttex";
+const uint32_t TEXTURE_CACHE_VERSION = 1;
+const int TEXTURE_TILE_LOG2 = 5;
+const int TEXTURE_TILE = 1 << TEXTURE_TILE_LOG2; // 32 x 32 texels, 4 KiB
+const int TEXTURE_CACHE_SHARDS = 16;
+const int TEXTURE_THREAD_TILES = 64; // tiles each thread reuses without locking
+
+struct TextureTile {
+    alignas(16) DWORD texels[TEXTURE_TILE * TEXTURE_TILE]; // Morton order
+};
+
+const size_t TEXTURE_SHARD_TILES = TEXTURE_CACHE_BYTES / TEXTURE_CACHE_SHARDS / sizeof(TextureTile);
+
+struct TextureCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_size;
+    int64_t source_time;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile_count; // all levels, finest first
+    uint32_t reserved;
+};
+
+// Interleaves the low 16 bits of x and y.
+unsigned MortonEncode(unsigned x, unsigned y) {
+    auto spread = [](unsigned v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Row-major indices of the tiles of a tiles_x x tiles_y grid, in Morton order.
+std::vector<uint32_t> MortonTileOrder(int tiles_x, int tiles_y) {
+    std::vector<uint32_t> order(static_cast<size_t>(tiles_x) * tiles_y);
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = static_cast<uint32_t>(i);
+    }
+    std::sort(order.begin(), order.end(), [tiles_x](uint32_t a, uint32_t b) {
+        return MortonEncode(a % tiles_x, a / tiles_x) < MortonEncode(b % tiles_x, b / tiles_x);
+    });
+    return order;
+}
+
+int TileCount(int texels) {
+    return (texels + TEXTURE_TILE - 1) >> TEXTURE_TILE_LOG2;
+}
+
+bool ReadPpm(const std::string& path, std::vector<DWORD>& pixels, int& width, int& height) {
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    int max_value = 0;
+    if (!(in >> magic >> width >> height >> max_value) || magic != "P6" || max_value != 255 ||
+        width <= 0 || height <= 0) {
+        return false;
+    }
+    in.get(); // single whitespace before the samples
+
+    std::vector<unsigned char> rgb(3 * static_cast<size_t>(width) * height);
+    if (!in.read(reinterpret_cast<char*>(rgb.data()), rgb.size())) {
+        return false;
+    }
+    pixels.resize(static_cast<size_t>(width) * height);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        pixels[i] = RGB(rgb[3 * i + 2], rgb[3 * i + 1], rgb[3 * i]);
+    }
+    return true;
+}
+
+// Builds the mip chain of an image and writes it, tiled, to cache_path.
+// Each level is a 2x2 box filter of the one above; odd sizes drop their
+// last row or column.
+bool WriteTextureCache(const std::string& cache_path, uint64_t source_size, int64_t source_time,
+    std::vector<DWORD> texels, int width, int height) {
+    uint32_t tile_count = 0;
+    for (int w = width, h = height; ; w = max(1, w / 2), h = max(1, h / 2)) {
+        tile_count += TileCount(w) * TileCount(h);
+        if (w == 1 && h == 1) break;
+    }
+    TextureCacheHeader header = { { 'R', 'T', 'T', 'X' }, TEXTURE_CACHE_VERSION, source_size, source_time,
+        static_cast<uint32_t>(width), static_cast<uint32_t>(height), tile_count, 0 };
+
+    std::ofstream out(TempCachePath(cache_path), std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    int level_width = width, level_height = height;
+    while (true) {
+        int tiles_x = TileCount(level_width);
+        for (uint32_t tile : MortonTileOrder(tiles_x, TileCount(level_height))) {
+            TextureTile data = {};
+            int x0 = (tile % tiles_x) * TEXTURE_TILE;
+            int y0 = (tile / tiles_x) * TEXTURE_TILE;
+            for (int y = 0; y < TEXTURE_TILE && y0 + y < level_height; y++) {
+                for (int x = 0; x < TEXTURE_TILE && x0 + x < level_width; x++) {
+                    data.texels[MortonEncode(x, y)] = texels[static_cast<size_t>(y0 + y) * level_width + x0 + x];
+                }
+            }
+            out.write(reinterpret_cast<const char*>(&data), sizeof(data));
+        }
+        if (level_width == 1 && level_height == 1) {
+            break;
+        }
+
+        int next_width = max(1, level_width / 2);
+        int next_height = max(1, level_height / 2);
+        std::vector<DWORD> next(static_cast<size_t>(next_width) * next_height);
+        for (int y = 0; y < next_height; y++) {
+            const DWORD* row0 = &texels[static_cast<size_t>(min(2 * y, level_height - 1)) * level_width];
+            const DWORD* row1 = &texels[static_cast<size_t>(min(2 * y + 1, level_height - 1)) * level_width];
+            for (int x = 0; x < next_width; x++) {
+                int x0 = min(2 * x, level_width - 1), x1 = min(2 * x + 1, level_width - 1);
+                __m128i top = _mm_avg_epu8(_mm_cvtsi32_si128(static_cast<int>(row0[x0])),
+                    _mm_cvtsi32_si128(static_cast<int>(row0[x1])));
+                __m128i bottom = _mm_avg_epu8(_mm_cvtsi32_si128(static_cast<int>(row1[x0])),
+                    _mm_cvtsi32_si128(static_cast<int>(row1[x1])));
+                next[static_cast<size_t>(y) * next_width + x] = static_cast<DWORD>(_mm_cvtsi128_si32(_mm_avg_epu8(top, bottom)));
+            }
+        }
+        texels.swap(next);
+        level_width = next_width;
+        level_height = next_height;
+    }
+    return CommitCacheFile(out, cache_path);
+}
+
+bool ReadAt(HANDLE file, uint64_t offset, void* data, DWORD size) {
+    OVERLAPPED at = {};
+    at.Offset = static_cast<DWORD>(offset);
+    at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD read = 0;
+    return ReadFile(file, data, size, &read, &at) && read == size;
+}
+
+std::atomic<uint32_t> nextTextureId{ 1 };
+
+// Opens a tiled cache file if it was made from this version of the source,
+// and lays out the tiles of its levels.
+bool OpenTextureCache(const std::string& cache_path, uint64_t source_size, int64_t source_time,
+    SampledTexture& texture) {
+    HANDLE file = CreateFileA(cache_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    TextureCacheHeader header;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || !ReadAt(file, 0, &header, sizeof(header)) ||
+        std::memcmp(header.magic, "RTTX", 4) != 0 || header.version != TEXTURE_CACHE_VERSION ||
+        header.source_size != source_size || header.source_time != source_time ||
+        header.width == 0 || header.height == 0 ||
+        static_cast<uint64_t>(file_size.QuadPart) != sizeof(header) + static_cast<uint64_t>(header.tile_count) * sizeof(TextureTile)) {
+        CloseHandle(file);
+        return false;
+    }
+
+    uint32_t first = 0;
+    int width = static_cast<int>(header.width), height = static_cast<int>(header.height);
+    while (true) {
+        TextureLevel level = { width, height, TileCount(width), {} };
+        std::vector<uint32_t> order = MortonTileOrder(level.tiles_x, TileCount(height));
+        level.tile_index.resize(order.size());
+        for (size_t rank = 0; rank < order.size(); rank++) {
+            level.tile_index[order[rank]] = first + static_cast<uint32_t>(rank);
+        }
+        first += static_cast<uint32_t>(order.size());
+        texture.levels.push_back(std::move(level));
+        if (width == 1 && height == 1) break;
+        width = max(1, width / 2);
+        height = max(1, height / 2);
+    }
+    if (first != header.tile_count) {
+        CloseHandle(file);
+        texture.levels.clear();
+        return false;
+    }
+
+    texture.file = file;
+    texture.id = nextTextureId++;
+    return true;
+}
+
+// Readies a texture for sampling, converting its image on first use.
+// Returns null when the image cannot be read.
+std::shared_ptr<const SampledTexture> OpenTexture(const Texture& texture) {
+    auto sampled = std::make_shared<SampledTexture>(texture);
+    if (texture.kind != TextureKind::IMAGE) {
+        return sampled;
+    }
+
+    std::error_code ec;
+    uint64_t source_size = std::filesystem::file_size(texture.path, ec);
+    if (ec) {
+        return nullptr;
+    }
+    int64_t source_time = static_cast<int64_t>(
+        std::filesystem::last_write_time(texture.path, ec).time_since_epoch().count());
+
+    std::string cache_path = texture.path + TEXTURE_CACHE_EXTENSION;
+    if (OpenTextureCache(cache_path, source_size, source_time, *sampled)) {
+        return sampled;
+    }
+
+    std::vector<DWORD> texels;
+    int width = 0, height = 0;
+    if (!ReadPpm(texture.path, texels, width, height) ||
+        !WriteTextureCache(cache_path, source_size, source_time, std::move(texels), width, height) ||
+        !OpenTextureCache(cache_path, source_size, source_time, *sampled)) {
+        return nullptr;
+    }
+    return sampled;
+}
+
+// Resident tiles, split into shards with their own lock and LRU list so the
+// render threads rarely contend. Each shard keeps its share of the budget.
+struct TextureCacheShard {
+    std::mutex mutex;
+    std::list<uint64_t> recent; // most recently used first
+    std::unordered_map<uint64_t, std::pair<std::shared_ptr<const TextureTile>, std::list<uint64_t>::iterator>> tiles;
+};
+
+std::array<TextureCacheShard, TEXTURE_CACHE_SHARDS> textureCache;
+
+// The tiles a thread used last, checked before the shared cache. They stay
+// alive here after an eviction until the slot is reused.
+struct TextureTileMemo {
+    uint64_t key = ~0ull;
+    std::shared_ptr<const TextureTile> tile;
+};
+thread_local std::array<TextureTileMemo, TEXTURE_THREAD_TILES> textureTileMemo;
+
+const TextureTile& TextureTileAt(const SampledTexture& texture, uint32_t tile) {
+    uint64_t key = static_cast<uint64_t>(texture.id) << 32 | tile;
+    uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+    TextureTileMemo& memo = textureTileMemo[(hash >> 32) % TEXTURE_THREAD_TILES];
+    if (memo.key == key) {
+        return *memo.tile;
+    }
+
+    TextureCacheShard& shard = textureCache[(hash >> 48) % TEXTURE_CACHE_SHARDS];
+    std::shared_ptr<const TextureTile> resident;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.tiles.find(key);
+        if (found != shard.tiles.end()) {
+            shard.recent.splice(shard.recent.begin(), shard.recent, found->second.second);
+            resident = found->second.first;
+        }
+    }
+
+    if (!resident) {
+        // Read outside the lock; threads racing for one tile both read it and
+        // the first to finish wins. A failed read leaves the tile black.
+        auto loaded = std::make_shared<TextureTile>();
+        ReadAt(texture.file, sizeof(TextureCacheHeader) + static_cast<uint64_t>(tile) * sizeof(TextureTile),
+            loaded->texels, sizeof(loaded->texels));
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto inserted = shard.tiles.emplace(key, std::make_pair(std::shared_ptr<const TextureTile>(loaded), shard.recent.end()));
+        if (inserted.second) {
+            shard.recent.push_front(key);
+            inserted.first->second.second = shard.recent.begin();
+            while (shard.tiles.size() > TEXTURE_SHARD_TILES) {
+                shard.tiles.erase(shard.recent.back());
+                shard.recent.pop_back();
+            }
+        }
+        resident = inserted.first->second.first;
+    }
+
+    memo.key = key;
+    memo.tile = std::move(resident);
+    return *memo.tile;
+}
+
+DWORD LevelTexel(const SampledTexture& texture, const TextureLevel& level, int x, int y) {
+    const TextureTile& tile = TextureTileAt(texture,
+        level.tile_index[(y >> TEXTURE_TILE_LOG2) * level.tiles_x + (x >> TEXTURE_TILE_LOG2)]);
+    return tile.texels[MortonEncode(x & (TEXTURE_TILE - 1), y & (TEXTURE_TILE - 1))];
+}
+
+__m128 UnpackTexel(DWORD texel) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_cvtsi32_si128(static_cast<int>(texel));
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+}
+
+// Bilinearly filtered texel of one level at (u, v) in [0, 1], wrapping
+// around the edges. The lanes hold the channels in canvas order.
+__m128 SampleBilinear(const SampledTexture& texture, int level_index, float u, float v) {
+    const TextureLevel& level = texture.levels[level_index];
+    float x = u * level.width - 0.5f;
+    float y = v * level.height - 0.5f;
+    float floor_x = std::floor(x), floor_y = std::floor(y);
+    __m128 fx = _mm_set1_ps(x - floor_x);
+    __m128 fy = _mm_set1_ps(y - floor_y);
+
+    int x0 = static_cast<int>(floor_x), y0 = static_cast<int>(floor_y);
+    x0 = x0 < 0 ? level.width - 1 : min(x0, level.width - 1);
+    y0 = y0 < 0 ? level.height - 1 : min(y0, level.height - 1);
+    int x1 = x0 + 1 == level.width ? 0 : x0 + 1;
+    int y1 = y0 + 1 == level.height ? 0 : y0 + 1;
+
+    __m128 t00, t10, t01, t11;
+    int tile_x = x0 >> TEXTURE_TILE_LOG2, tile_y = y0 >> TEXTURE_TILE_LOG2;
+    if (tile_x == x1 >> TEXTURE_TILE_LOG2 && tile_y == y1 >> TEXTURE_TILE_LOG2) {
+        const TextureTile& tile = TextureTileAt(texture, level.tile_index[tile_y * level.tiles_x + tile_x]);
+        int lx0 = x0 & (TEXTURE_TILE - 1), ly0 = y0 & (TEXTURE_TILE - 1);
+        int lx1 = x1 & (TEXTURE_TILE - 1), ly1 = y1 & (TEXTURE_TILE - 1);
+        if (x1 == x0 + 1 && y1 == y0 + 1 && (lx0 & 1) == 0 && (ly0 & 1) == 0) {
+            // The four texels are one aligned Morton quad.
+            __m128i quad = _mm_load_si128(reinterpret_cast<const __m128i*>(&tile.texels[MortonEncode(lx0, ly0)]));
+            __m128i zero = _mm_setzero_si128();
+            __m128i low = _mm_unpacklo_epi8(quad, zero);
+            __m128i high = _mm_unpackhi_epi8(quad, zero);
+            t00 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero));
+            t10 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero));
+            t01 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero));
+            t11 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(high, zero));
+        }
+        else {
+            t00 = UnpackTexel(tile.texels[MortonEncode(lx0, ly0)]);
+            t10 = UnpackTexel(tile.texels[MortonEncode(lx1, ly0)]);
+            t01 = UnpackTexel(tile.texels[MortonEncode(lx0, ly1)]);
+            t11 = UnpackTexel(tile.texels[MortonEncode(lx1, ly1)]);
+        }
+    }
+    else {
+        t00 = UnpackTexel(LevelTexel(texture, level, x0, y0));
+        t10 = UnpackTexel(LevelTexel(texture, level, x1, y0));
+        t01 = UnpackTexel(LevelTexel(texture, level, x0, y1));
+        t11 = UnpackTexel(LevelTexel(texture, level, x1, y1));
+    }
+
+    __m128 top = _mm_add_ps(t00, _mm_mul_ps(fx, _mm_sub_ps(t10, t00)));
+    __m128 bottom = _mm_add_ps(t01, _mm_mul_ps(fx, _mm_sub_ps(t11, t01)));
+    return _mm_add_ps(top, _mm_mul_ps(fy, _mm_sub_ps(bottom, top)));
+}
+
+// Fraction of a checkerboard with unit cells that is color_b over a box
+// footprint of the given width around (s, t): the closed-form integral of
+// the square wave along each axis, so the pattern fades to its mean instead
+// of aliasing once cells shrink below a pixel.
+float CheckerCoverage(float s, float t, float width) {
+    width = max(width, 1e-4f);
+    auto filtered = [width](float p) {
+        auto triangle = [](float q) {
+            q *= 0.5f;
+            return std::abs(q - std::floor(q) - 0.5f);
+        };
+        return 2.f * (triangle(p - 0.5f * width) - triangle(p + 0.5f * width)) / width;
+    };
+    return 0.5f - 0.5f * filtered(s) * filtered(t);
+}
+
+// Filtered color of a texture at (s, t), in repeats of the texture, over a
+// footprint `width` repeats across. Images are filtered trilinearly.
+Color SampleTexture(const SampledTexture& texture, float s, float t, float width) {
+    if (texture.source.kind == TextureKind::CHECKER) {
+        float coverage = CheckerCoverage(s, t, width);
+        return Add(Multiply(1.f - coverage, texture.source.color_a), Multiply(coverage, texture.source.color_b));
+    }
+
+    const TextureLevel& finest = texture.levels[0];
+    float texels = width * max(finest.width, finest.height);
+    float lod = texels > 1.f ? min(std::log2(texels), static_cast<float>(texture.levels.size() - 1)) : 0.f;
+    int level = static_cast<int>(lod);
+    float u = s - std::floor(s), v = t - std::floor(t);
+
+    __m128 color = SampleBilinear(texture, level, u, v);
+    if (lod > level) {
+        __m128 coarser = SampleBilinear(texture, level + 1, u, v);
+        color = _mm_add_ps(color, _mm_mul_ps(_mm_set1_ps(lod - level), _mm_sub_ps(coarser, color)));
+    }
+
+    alignas(16) int channels[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(channels), _mm_cvtps_epi32(color));
+    return { static_cast<unsigned>(channels[0]), static_cast<unsigned>(channels[1]), static_cast<unsigned>(channels[2]) };
+}
+
+// =============================================================================
+//                          Acceleration structures
+// =============================================================================
+
+const int BVH_BINS = 12;
+
+// Traversal keeps its node stack on the C++ stack, so trees may be at most
+// BVH_MAX_DEPTH deep. Below BVH_SAH_MAX_DEPTH nodes are split at the median
+// instead, which adds at most log2(primitives) <= 31 more levels.
+const int BVH_MAX_DEPTH = 64;
+const int BVH_SAH_MAX_DEPTH = 32;
+
+Aabb EmptyAabb() {
+    return { { INFINITY, INFINITY, INFINITY }, { -INFINITY, -INFINITY, -INFINITY } };
+}
+
+void GrowAabb(Aabb& box, const Vector3& point) {
+    box.min_corner = { min(box.min_corner.x, point.x), min(box.min_corner.y, point.y), min(box.min_corner.z, point.z) };
+    box.max_corner = { max(box.max_corner.x, point.x), max(box.max_corner.y, point.y), max(box.max_corner.z, point.z) };
+}
+
+void GrowAabb(Aabb& box, const Aabb& other) {
+    GrowAabb(box, other.min_corner);
+    GrowAabb(box, other.max_corner);
+}
+
+float SurfaceArea(const Aabb& box) {
+    Vector3 d = Subtract(box.max_corner, box.min_corner);
+    if (d.x < 0) {
+        return 0.f;
+    }
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+float AxisOf(const Vector3& v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// Recursively splits prim_indices[first, first + count) with a binned SAH,
+// or at the centroid median once depth reaches BVH_SAH_MAX_DEPTH.
+void BuildBvhNode(Bvh& bvh, const std::vector<Aabb>& prim_bounds,
+    const std::vector<Vector3>& centroids, int node_index, int first, int count, int max_leaf_size, int depth) {
+    Aabb bounds = EmptyAabb();
+    Aabb centroid_bounds = EmptyAabb();
+    for (int i = first; i < first + count; i++) {
+        GrowAabb(bounds, prim_bounds[bvh.prim_indices[i]]);
+        GrowAabb(centroid_bounds, centroids[bvh.prim_indices[i]]);
+    }
+    bvh.nodes[node_index] = { bounds, first, count };
+
+    if (count <= max_leaf_size) {
+        return;
+    }
+
+    int best_axis = -1;
+    int best_split = 0;
+    float best_cost = INFINITY;
+
+    for (int axis = 0; axis < 3 && depth < BVH_SAH_MAX_DEPTH; axis++) {
+        float lo = AxisOf(centroid_bounds.min_corner, axis);
+        float extent = AxisOf(centroid_bounds.max_corner, axis) - lo;
+        if (extent <= 0) {
+            continue;
+        }
+
+        Aabb bin_bounds[BVH_BINS];
+        int bin_counts[BVH_BINS] = {};
+        for (Aabb& b : bin_bounds) {
+            b = EmptyAabb();
+        }
+
+        float scale = BVH_BINS / extent;
+        for (int i = first; i < first + count; i++) {
+            int prim = bvh.prim_indices[i];
+            int bin = min(BVH_BINS - 1, static_cast<int>((AxisOf(centroids[prim], axis) - lo) * scale));
+            bin_counts[bin]++;
+            GrowAabb(bin_bounds[bin], prim_bounds[prim]);
+        }
+
+        // Sweep from the right to get the cost of every right-hand side.
+        float right_area[BVH_BINS];
+        int right_count[BVH_BINS];
+        Aabb acc = EmptyAabb();
+        int acc_count = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--) {
+            GrowAabb(acc, bin_bounds[b]);
+            acc_count += bin_counts[b];
+            right_area[b] = SurfaceArea(acc);
+            right_count[b] = acc_count;
+        }
+
+        acc = EmptyAabb();
+        acc_count = 0;
+        for (int b = 1; b < BVH_BINS; b++) {
+            GrowAabb(acc, bin_bounds[b - 1]);
+            acc_count += bin_counts[b - 1];
+            if (acc_count == 0 || right_count[b] == 0) {
+                continue;
+            }
+
+            float cost = SurfaceArea(acc) * acc_count + right_area[b] * right_count[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    int mid;
+    if (best_axis >= 0) {
+        float lo = AxisOf(centroid_bounds.min_corner, best_axis);
+        float scale = BVH_BINS / (AxisOf(centroid_bounds.max_corner, best_axis) - lo);
+        auto split = std::partition(bvh.prim_indices.begin() + first, bvh.prim_indices.begin() + first + count,
+            [&](int prim) {
+                return min(BVH_BINS - 1, static_cast<int>((AxisOf(centroids[prim], best_axis) - lo) * scale)) < best_split;
+            });
+        mid = static_cast<int>(split - bvh.prim_indices.begin());
+    }
+    else {
+        // Too deep for SAH, or all centroids coincide: halve along the widest axis.
+        Vector3 extent = Subtract(centroid_bounds.max_corner, centroid_bounds.min_corner);
+        int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        mid = first + count / 2;
+        std::nth_element(bvh.prim_indices.begin() + first, bvh.prim_indices.begin() + mid,
+            bvh.prim_indices.begin() + first + count,
+            [&](int a, int b) { return AxisOf(centroids[a], axis) < AxisOf(centroids[b], axis); });
+    }
+
+    int left = static_cast<int>(bvh.nodes.size());
+    bvh.nodes.push_back({});
+    bvh.nodes.push_back({});
+    bvh.nodes[node_index].first = left;
+    bvh.nodes[node_index].count = 0;
+
+    BuildBvhNode(bvh, prim_bounds, centroids, left, first, mid - first, max_leaf_size, depth + 1);
+    BuildBvhNode(bvh, prim_bounds, centroids, left + 1, mid, first + count - mid, max_leaf_size, depth + 1);
+}
+
+Bvh BuildBvh(const std::vector<Aabb>& prim_bounds, int max_leaf_size) {
+    TRACE_ZONE("BuildBvh");
+
+    Bvh bvh;
+    std::vector<Vector3> centroids(prim_bounds.size());
+    for (size_t i = 0; i < prim_bounds.size(); i++) {
+        centroids[i] = Multiply(0.5f, Add(prim_bounds[i].min_corner, prim_bounds[i].max_corner));
+        bvh.prim_indices.push_back(static_cast<int>(i));
+    }
+
+    bvh.nodes.reserve(2 * prim_bounds.size() + 1);
+    bvh.nodes.push_back({ EmptyAabb(), 0, 0 });
+    if (!prim_bounds.empty()) {
+        BuildBvhNode(bvh, prim_bounds, centroids, 0, 0, static_cast<int>(prim_bounds.size()), max_leaf_size, 0);
+    }
+    return bvh;
+}
+
+// Builds the BVH over the triangles and packs every leaf into one packet.
+MeshAccel BuildMeshAccel(const TriangleMesh& mesh, int material) {
+    MeshAccel accel = { {}, {}, mesh.vertices, mesh.indices, material };
+
+    int num_triangles = static_cast<int>(mesh.indices.size() / 3);
+    std::vector<Aabb> prim_bounds(num_triangles, EmptyAabb());
+    for (int i = 0; i < num_triangles; i++) {
+        for (int k = 0; k < 3; k++) {
+            GrowAabb(prim_bounds[i], mesh.vertices[mesh.indices[3 * i + k]]);
+        }
+    }
+
+    accel.bvh = BuildBvh(prim_bounds, 4);
+
+    for (BvhNode& node : accel.bvh.nodes) {
+        if (node.count == 0) {
+            continue;
+        }
+
+        TrianglePacket packet = {};
+        for (int lane = 0; lane < 4; lane++) {
+            packet.triangle[lane] = lane < node.count ? accel.bvh.prim_indices[node.first + lane] : -1;
+            if (packet.triangle[lane] < 0) {
+                continue;
+            }
+
+            const int* tri = &mesh.indices[3 * packet.triangle[lane]];
+            const Vector3* verts[3] = { &mesh.vertices[tri[0]], &mesh.vertices[tri[1]], &mesh.vertices[tri[2]] };
+            for (int axis = 0; axis < 3; axis++) {
+                packet.v0[axis][lane] = AxisOf(*verts[0], axis);
+                packet.v1[axis][lane] = AxisOf(*verts[1], axis);
+                packet.v2[axis][lane] = AxisOf(*verts[2], axis);
+            }
+        }
+
+        node.first = static_cast<int>(accel.packets.size());
+        accel.packets.push_back(packet);
+    }
+
+    return accel;
+}
+
+// Builds the bottom level of a geometry set: a BVH over its spheres and one
+// per mesh.
+GeometryAccel BuildGeometryAccel(const GeometrySet& set, MaterialTable& table) {
+    GeometryAccel accel;
+    accel.bounds = EmptyAabb();
+
+    std::vector<Aabb> sphere_bounds;
+    for (const Sphere& sphere : set.spheres) {
+        accel.spheres.push_back({ sphere.center, sphere.radius,
+            table.Intern(sphere.color, sphere.specular, sphere.reflective, sphere.texture) });
+        Vector3 extent = { sphere.radius, sphere.radius, sphere.radius };
+        sphere_bounds.push_back({ Subtract(sphere.center, extent), Add(sphere.center, extent) });
+        GrowAabb(accel.bounds, sphere_bounds.back());
+    }
+    accel.sphere_bvh = BuildBvh(sphere_bounds, 2);
+
+    for (const TriangleMesh& mesh : set.meshes) {
+        accel.meshes.push_back(BuildMeshAccel(mesh, table.Intern(mesh.color, mesh.specular, mesh.reflective, mesh.texture)));
+        GrowAabb(accel.bounds, accel.meshes.back().bvh.nodes[0].bounds);
+    }
+    return accel;
+}
+
+// Recomputes the bounds of every subtree from prim_bounds.
+Aabb RefitNode(Bvh& bvh, const std::vector<Aabb>& prim_bounds, int node_index) {
+    BvhNode& node = bvh.nodes[node_index];
+    Aabb bounds = EmptyAabb();
+
+    if (node.count > 0) {
+        for (int i = node.first; i < node.first + node.count; i++) {
+            GrowAabb(bounds, prim_bounds[bvh.prim_indices[i]]);
+        }
+    }
+    else {
+        GrowAabb(bounds, RefitNode(bvh, prim_bounds, node.first));
+        GrowAabb(bounds, RefitNode(bvh, prim_bounds, node.first + 1));
+    }
+
+    node.bounds = bounds;
+    return bounds;
+}
+
+// Updates the node bounds of a BVH whose primitives moved, keeping its
+// topology. A large tree is cut into a few subtrees per thread that are refit
+// in parallel; the nodes above the cut are then done bottom-up.
+void RefitBvh(Bvh& bvh, const std::vector<Aabb>& prim_bounds, unsigned num_threads) {
+    TRACE_ZONE("RefitBvh");
+
+    if (bvh.prim_indices.empty()) {
+        return;
+    }
+    if (bvh.nodes.size() < BVH_PARALLEL_REFIT_NODES || num_threads <= 1) {
+        RefitNode(bvh, prim_bounds, 0); // starting threads would cost more than the refit
+        return;
+    }
+
+    std::vector<int> cut = { 0 };
+    std::vector<int> above;
+    while (cut.size() < 4 * num_threads) {
+        std::vector<int> next;
+        for (int node_index : cut) {
+            const BvhNode& node = bvh.nodes[node_index];
+            if (node.count > 0) {
+                next.push_back(node_index);
+                continue;
+            }
+            above.push_back(node_index);
+            next.push_back(node.first);
+            next.push_back(node.first + 1);
+        }
+        if (next.size() == cut.size()) {
+            break; // only leaves left
+        }
+        cut.swap(next);
+    }
+
+    std::atomic<size_t> next_root{ 0 };
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < min(num_threads, static_cast<unsigned>(cut.size())); i++) {
+        workers.emplace_back([&] {
+            for (size_t k = next_root++; k < cut.size(); k = next_root++) {
+                RefitNode(bvh, prim_bounds, cut[k]);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    // Parents were recorded before their children, so walk backwards.
+    for (auto it = above.rbegin(); it != above.rend(); ++it) {
+        BvhNode& node = bvh.nodes[*it];
+        node.bounds = bvh.nodes[node.first].bounds;
+        GrowAabb(node.bounds, bvh.nodes[node.first + 1].bounds);
+    }
+}
+
+// Surface area of every node, indexed like bvh.nodes.
+std::vector<float> NodeAreas(const Bvh& bvh) {
+    std::vector<float> areas(bvh.nodes.size());
+    for (size_t i = 0; i < bvh.nodes.size(); i++) {
+        areas[i] = SurfaceArea(bvh.nodes[i].bounds);
+    }
+    return areas;
+}
+
+// SAH cost of the tree relative to its root, with a traversal step costing
+// the same as one primitive test. Only reachable nodes count.
+float BvhSahCost(const Bvh& bvh) {
+    float root_area = SurfaceArea(bvh.nodes[0].bounds);
+    if (bvh.prim_indices.empty() || root_area <= 0) {
+        return 0;
+    }
+
+    float cost = 0;
+    std::vector<int> stack = { 0 };
+    while (!stack.empty()) {
+        const BvhNode& node = bvh.nodes[stack.back()];
+        stack.pop_back();
+        cost += SurfaceArea(node.bounds) * (node.count > 0 ? node.count : 1);
+        if (node.count == 0) {
+            stack.push_back(node.first);
+            stack.push_back(node.first + 1);
+        }
+    }
+    return cost / root_area;
+}
+
+// Rebuilds, on a copy, the topmost subtrees whose area grew by more than
+// BVH_TREELET_AREA_RATIO since they were built. A subtree's primitives are a
+// contiguous range of prim_indices, so it is rebuilt in place: its root keeps
+// its slot and the new descendants are appended, orphaning the old ones. When
+// the root itself qualifies, nothing does, or orphans pile up, the whole tree
+// is rebuilt instead.
+BvhRebuild RebuildTreelets(Bvh bvh, std::vector<float> built_area, std::vector<Aabb> prim_bounds,
+    int max_leaf_size) {
+    TraceSetThread(TRACE_REBUILD_SLOT); // at most one rebuild is pending at a time
+    TRACE_ZONE("RebuildTreelets");
+
+    std::vector<std::pair<int, int>> roots; // node, depth
+    std::vector<std::pair<int, int>> stack = { { 0, 0 } };
+    while (!stack.empty()) {
+        int node_index = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+        const BvhNode& node = bvh.nodes[node_index];
+        if (SurfaceArea(node.bounds) > BVH_TREELET_AREA_RATIO * built_area[node_index]) {
+            roots.push_back({ node_index, depth });
+        }
+        else if (node.count == 0) {
+            stack.push_back({ node.first, depth + 1 });
+            stack.push_back({ node.first + 1, depth + 1 });
+        }
+    }
+
+    if (roots.empty() || roots[0].first == 0 || bvh.nodes.size() > 4 * prim_bounds.size()) {
+        Bvh fresh = BuildBvh(prim_bounds, max_leaf_size);
+        std::vector<float> areas = NodeAreas(fresh);
+        float cost = BvhSahCost(fresh);
+        return { std::move(fresh), std::move(areas), cost };
+    }
+
+    std::vector<Vector3> centroids(prim_bounds.size());
+    for (size_t i = 0; i < prim_bounds.size(); i++) {
+        centroids[i] = Multiply(0.5f, Add(prim_bounds[i].min_corner, prim_bounds[i].max_corner));
+    }
+
+    for (const std::pair<int, int>& treelet : roots) {
+        int root = treelet.first;
+        // The range runs from the leftmost leaf to the end of the rightmost one.
+        int left = root, right = root;
+        while (bvh.nodes[left].count == 0) left = bvh.nodes[left].first;
+        while (bvh.nodes[right].count == 0) right = bvh.nodes[right].first + 1;
+        int first = bvh.nodes[left].first;
+        int end = bvh.nodes[right].first + bvh.nodes[right].count;
+
+        size_t old_size = bvh.nodes.size();
+        BuildBvhNode(bvh, prim_bounds, centroids, root, first, end - first, max_leaf_size, treelet.second);
+
+        built_area.resize(bvh.nodes.size());
+        built_area[root] = SurfaceArea(bvh.nodes[root].bounds);
+        for (size_t i = old_size; i < bvh.nodes.size(); i++) {
+            built_area[i] = SurfaceArea(bvh.nodes[i].bounds);
+        }
+    }
+
+    float cost = BvhSahCost(bvh);
+    return { std::move(bvh), std::move(built_area), cost };
+}
+
+// World bounds of every instance; also refreshes the cached inverses.
+std::vector<Aabb> InstanceBounds(Scene& scene) {
+    std::vector<Aabb> instance_bounds(scene.instances.size(), EmptyAabb());
+    scene.instance_inverse.resize(scene.instances.size());
+
+    for (size_t i = 0; i < scene.instances.size(); i++) {
+        const Instance& instance = scene.instances[i];
+        const Aabb& local = scene.geometries[instance.geometry].bounds;
+        scene.instance_inverse[i] = Inverse(instance.transform);
+
+        for (int corner = 0; corner < 8; corner++) {
+            Vector3 p = {
+                corner & 1 ? local.max_corner.x : local.min_corner.x,
+                corner & 2 ? local.max_corner.y : local.min_corner.y,
+                corner & 4 ? local.max_corner.z : local.min_corner.z
+            };
+            GrowAabb(instance_bounds[i], Add(MultiplyMV(instance.transform, p), instance.translation));
+        }
+    }
+    return instance_bounds;
+}
+
+// Rebuilds the top level from scene.instances. Only instance bounds are
+// binned, so this is cheap next to the bottom levels.
+void BuildTopLevel(Scene& scene) {
+    TRACE_ZONE("BuildTopLevel");
+
+    if (scene.instance_rebuild.valid()) {
+        scene.instance_rebuild.wait(); // superseded
+        scene.instance_rebuild = {};
+    }
+
+    scene.instance_bvh = BuildBvh(InstanceBounds(scene), 2);
+    scene.instance_built_area = NodeAreas(scene.instance_bvh);
+    scene.instance_built_cost = BvhSahCost(scene.instance_bvh);
+}
+
+// Per-frame update after instances moved. Refits the top level in place and,
+// once its SAH cost has degraded past BVH_REBUILD_COST_RATIO, reoptimizes a
+// copy of it on a background thread. The copy is swapped in by the first call
+// after it is done and refit to the bounds of that frame.
+void UpdateTopLevel(Scene& scene, unsigned num_threads) {
+    TRACE_ZONE("UpdateTopLevel");
+
+    std::vector<Aabb> instance_bounds = InstanceBounds(scene);
+
+    if (scene.instance_rebuild.valid() &&
+        scene.instance_rebuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        BvhRebuild rebuild = scene.instance_rebuild.get();
+        scene.instance_bvh = std::move(rebuild.bvh);
+        scene.instance_built_area = std::move(rebuild.built_area);
+        scene.instance_built_cost = rebuild.cost;
+    }
+
+    RefitBvh(scene.instance_bvh, instance_bounds, num_threads);
+
+    if (!scene.instance_rebuild.valid() &&
+        BvhSahCost(scene.instance_bvh) > BVH_REBUILD_COST_RATIO * scene.instance_built_cost) {
+        scene.instance_rebuild = std::async(std::launch::async, RebuildTreelets,
+            scene.instance_bvh, scene.instance_built_area, std::move(instance_bounds), 2);
+    }
+}
+
+LightTree BuildLightTree(const std::vector<Light>& point_lights) {
+    TRACE_ZONE("BuildLightTree");
+
+    LightTree tree;
+    tree.lights = point_lights;
+
+    // Point boxes have no area for the SAH to weigh, so every light is padded
+    // by a small fraction of the spread of all of them.
+    Aabb extent = EmptyAabb();
+    for (const Light& light : point_lights) {
+        GrowAabb(extent, light.position);
+    }
+    float pad = max(EPSILON, 0.01f * Length(Subtract(extent.max_corner, extent.min_corner)));
+    Vector3 pad_vector = { pad, pad, pad };
+
+    std::vector<Aabb> light_bounds;
+    for (const Light& light : point_lights) {
+        light_bounds.push_back({ Subtract(light.position, pad_vector), Add(light.position, pad_vector) });
+    }
+    tree.bvh = BuildBvh(light_bounds, 1);
+
+    // Children always come after their parent.
+    tree.intensity.resize(tree.bvh.nodes.size());
+    tree.representative.resize(tree.bvh.nodes.size());
+    for (int i = static_cast<int>(tree.bvh.nodes.size()) - 1; i >= 0; i--) {
+        const BvhNode& node = tree.bvh.nodes[i];
+        if (node.count > 0) {
+            tree.representative[i] = tree.bvh.prim_indices[node.first];
+            tree.intensity[i] = tree.lights[tree.representative[i]].intensity;
+            continue;
+        }
+        int brighter = tree.intensity[node.first] >= tree.intensity[node.first + 1] ? node.first : node.first + 1;
+        tree.representative[i] = tree.representative[brighter];
+        tree.intensity[i] = tree.intensity[node.first] + tree.intensity[node.first + 1];
+    }
+
+    return tree;
+}
+
+Scene BuildScene(const std::vector<Sphere>& spheres, const std::vector<Plane>& planes,
+    const std::vector<Box>& boxes, const std::vector<TriangleMesh>& meshes,
+    const std::vector<GeometrySet>& geometry_sets, const std::vector<Instance>& instances,
+    const std::vector<Light>& lights, const std::vector<Texture>& textures) {
+    Scene scene;
+    MaterialTable table;
+    scene.lights = lights;
+    for (const Texture& texture : textures) {
+        scene.textures.push_back(OpenTexture(texture));
+    }
+
+    for (const Sphere& sphere : spheres) {
+        scene.spheres.push_back({ sphere.center, sphere.radius,
+            table.Intern(sphere.color, sphere.specular, sphere.reflective, sphere.texture) });
+    }
+
+    for (const Plane& plane : planes) {
+        scene.planes.normal_x.push_back(plane.normal.x);
+        scene.planes.normal_y.push_back(plane.normal.y);
+        scene.planes.normal_z.push_back(plane.normal.z);
+        scene.planes.offset.push_back(plane.offset);
+        scene.planes.material.push_back(table.Intern(plane.color, plane.specular, plane.reflective, plane.texture));
+    }
+
+    for (const Box& box : boxes) {
+        scene.boxes.min_x.push_back(box.min_corner.x);
+        scene.boxes.min_y.push_back(box.min_corner.y);
+        scene.boxes.min_z.push_back(box.min_corner.z);
+        scene.boxes.max_x.push_back(box.max_corner.x);
+        scene.boxes.max_y.push_back(box.max_corner.y);
+        scene.boxes.max_z.push_back(box.max_corner.z);
+        scene.boxes.material.push_back(table.Intern(box.color, box.specular, box.reflective, box.texture));
+    }
+
+    for (const TriangleMesh& mesh : meshes) {
+        scene.meshes.push_back(BuildMeshAccel(mesh, table.Intern(mesh.color, mesh.specular, mesh.reflective, mesh.texture)));
+    }
+
+    for (const GeometrySet& set : geometry_sets) {
+        scene.geometries.push_back(BuildGeometryAccel(set, table));
+    }
+    scene.materials = std::move(table.materials);
+
+    std::vector<Light> point_lights;
+    for (const Light& light : lights) {
+        if (light.ltype == LightType::POINT) {
+            point_lights.push_back(light);
+        }
+    }
+    if (point_lights.size() >= LIGHT_TREE_MIN_LIGHTS) {
+        scene.light_tree = BuildLightTree(point_lights);
+        scene.lights.erase(std::remove_if(scene.lights.begin(), scene.lights.end(),
+            [](const Light& light) { return light.ltype == LightType::POINT; }), scene.lights.end());
+    }
+    scene.instances = instances;
+    BuildTopLevel(scene);
+
+    return scene;
+}
+
+// =============================================================================
+//                             Geometry streaming
+// =============================================================================
+// "--stream <file>" renders a mesh without keeping it in memory. It is split
+// once into spatial chunks of at most STREAM_CHUNK_TRIANGLES, each with its
+// own BVH and triangle packets, and written to a chunk file next to the
+// source. At render time only the chunk bounds are resident: chunks are
+// mapped on first use and unmapped least recently used first once
+// GEOMETRY_CACHE_BYTES are mapped.
+
+const char* const STREAM_FILE_EXTENSION = ".rtchunks";
+const uint32_t STREAM_FILE_VERSION = 1;
+const int STREAM_CHUNK_TRIANGLES = 1 << 16;
+const uint64_t STREAM_CHUNK_ALIGN = 1 << 16; // views must start on the allocation granularity
+
+struct StreamFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_size;
+    int64_t source_time;
+    uint32_t chunk_count;
+    uint32_t reserved;
+};
+
+uint64_t AlignChunkOffset(uint64_t offset) {
+    return (offset + STREAM_CHUNK_ALIGN - 1) / STREAM_CHUNK_ALIGN * STREAM_CHUNK_ALIGN;
+}
+
+size_t ChunkBytes(const StreamChunk& chunk) {
+    return chunk.node_count * sizeof(BvhNode) + chunk.packet_count * sizeof(TrianglePacket);
+}
+
+// Splits the triangles into spatially coherent runs of at most
+// STREAM_CHUNK_TRIANGLES by median splits of their centroids along the
+// widest axis. Neighbouring runs come out next to each other.
+std::vector<std::vector<int>> PartitionTriangles(const TriangleMesh& mesh) {
+    int num_triangles = static_cast<int>(mesh.indices.size() / 3);
+    std::vector<Vector3> centroids(num_triangles);
+    std::vector<int> order(num_triangles);
+    for (int i = 0; i < num_triangles; i++) {
+        const int* tri = &mesh.indices[3 * i];
+        centroids[i] = Multiply(1.f / 3, Add(mesh.vertices[tri[0]], Add(mesh.vertices[tri[1]], mesh.vertices[tri[2]])));
+        order[i] = i;
+    }
+
+    std::vector<std::vector<int>> parts;
+    std::vector<std::pair<int, int>> pending = { { 0, num_triangles } }; // first, count
+    while (!pending.empty()) {
+        int first = pending.back().first;
+        int count = pending.back().second;
+        pending.pop_back();
+        if (count <= STREAM_CHUNK_TRIANGLES) {
+            parts.emplace_back(order.begin() + first, order.begin() + first + count);
+            continue;
+        }
+
+        Aabb bounds = EmptyAabb();
+        for (int k = first; k < first + count; k++) {
+            GrowAabb(bounds, centroids[order[k]]);
+        }
+        Vector3 extent = Subtract(bounds.max_corner, bounds.min_corner);
+        int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+        int half = count / 2;
+        std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+            [&](int a, int b) { return AxisOf(centroids[a], axis) < AxisOf(centroids[b], axis); });
+        pending.push_back({ first + half, count - half });
+        pending.push_back({ first, half });
+    }
+    return parts;
+}
+
+// Writes the chunk file of a mesh: header, chunk table, then the chunks, each
+// starting on a STREAM_CHUNK_ALIGN boundary so it can be mapped by itself.
+bool WriteStreamFile(const std::string& stream_path, uint64_t source_size, int64_t source_time,
+    const TriangleMesh& mesh) {
+    TRACE_ZONE("WriteStreamFile");
+
+    std::vector<std::vector<int>> parts = PartitionTriangles(mesh);
+    std::vector<StreamChunk> chunks(parts.size());
+    StreamFileHeader header = { { 'R', 'T', 'S', 'C' }, STREAM_FILE_VERSION, source_size, source_time,
+        static_cast<uint32_t>(chunks.size()), 0 };
+
+    std::ofstream out(TempCachePath(stream_path), std::ios::binary | std::ios::trunc);
+    uint64_t offset = AlignChunkOffset(sizeof(header) + chunks.size() * sizeof(StreamChunk));
+    for (size_t c = 0; c < parts.size(); c++) {
+        // Packets carry their own vertices, so the part's are not shared.
+        TriangleMesh part = { {}, {}, { 0, 0, 0 }, 0, 0.f };
+        for (int triangle : parts[c]) {
+            for (int k = 0; k < 3; k++) {
+                part.indices.push_back(static_cast<int>(part.vertices.size()));
+                part.vertices.push_back(mesh.vertices[mesh.indices[3 * triangle + k]]);
+            }
+        }
+
+        MeshAccel accel = BuildMeshAccel(part, 0);
+        for (size_t p = 0; p < accel.packets.size(); p++) {
+            for (int lane = 0; lane < 4; lane++) {
+                if (accel.packets[p].triangle[lane] >= 0) {
+                    accel.packets[p].triangle[lane] = static_cast<int>(4 * p + lane);
+                }
+            }
+        }
+
+        chunks[c] = { accel.bvh.nodes[0].bounds, offset,
+            static_cast<uint32_t>(accel.bvh.nodes.size()), static_cast<uint32_t>(accel.packets.size()) };
+        out.seekp(static_cast<std::streamoff>(offset));
+        out.write(reinterpret_cast<const char*>(accel.bvh.nodes.data()), accel.bvh.nodes.size() * sizeof(BvhNode));
+        out.write(reinterpret_cast<const char*>(accel.packets.data()), accel.packets.size() * sizeof(TrianglePacket));
+        offset = AlignChunkOffset(offset + ChunkBytes(chunks[c]));
+    }
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(chunks.data()), chunks.size() * sizeof(StreamChunk));
+    return CommitCacheFile(out, stream_path);
+}
+
+// Opens a chunk file made from this version of the source. Only the header
+// and the chunk table are read.
+bool ReadStreamFile(const std::string& stream_path, uint64_t source_size, int64_t source_time,
+    StreamedMesh& mesh) {
+    HANDLE file = CreateFileA(stream_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    StreamFileHeader header;
+    LARGE_INTEGER file_size;
+    bool valid = GetFileSizeEx(file, &file_size) && ReadAt(file, 0, &header, sizeof(header)) &&
+        std::memcmp(header.magic, "RTSC", 4) == 0 && header.version == STREAM_FILE_VERSION &&
+        header.source_size == source_size && header.source_time == source_time && header.chunk_count > 0;
+
+    std::vector<StreamChunk> chunks;
+    if (valid) {
+        chunks.resize(header.chunk_count);
+        valid = ReadAt(file, sizeof(header), chunks.data(), static_cast<DWORD>(chunks.size() * sizeof(StreamChunk)));
+        for (const StreamChunk& chunk : chunks) {
+            valid = valid && chunk.offset % STREAM_CHUNK_ALIGN == 0 && chunk.node_count > 0 &&
+                chunk.offset + ChunkBytes(chunk) <= static_cast<uint64_t>(file_size.QuadPart);
+        }
+    }
+
+    HANDLE mapping = valid ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+    if (mapping == nullptr) {
+        CloseHandle(file);
+        return false;
+    }
+
+    std::vector<Aabb> bounds;
+    for (const StreamChunk& chunk : chunks) {
+        bounds.push_back(chunk.bounds);
+    }
+    mesh.file = file;
+    mesh.mapping = mapping;
+    mesh.chunk_bvh = BuildBvh(bounds, 1);
+    mesh.chunks = std::move(chunks);
+    mesh.resident.assign(mesh.chunks.size(), nullptr);
+    mesh.position.resize(mesh.chunks.size());
+    return true;
+}
+
+// Opens the chunk file of an .obj or .ply file, writing it first when it is
+// missing or older than the source. Writing it needs the whole mesh in
+// memory once; rendering from it does not.
+bool OpenStreamedMesh(const std::string& path, unsigned num_threads, StreamedMesh& mesh) {
+    TRACE_ZONE("OpenStreamedMesh");
+
+    std::error_code ec;
+    uint64_t source_size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return false;
+    }
+    int64_t source_time = static_cast<int64_t>(
+        std::filesystem::last_write_time(path, ec).time_since_epoch().count());
+
+    std::string stream_path = path + STREAM_FILE_EXTENSION;
+    if (ReadStreamFile(stream_path, source_size, source_time, mesh)) {
+        return true;
+    }
+
+    TriangleMesh source = { {}, {}, { 0, 0, 0 }, 0, 0.f };
+    return LoadMesh(path, num_threads, source) && !source.indices.empty() &&
+        WriteStreamFile(stream_path, source_size, source_time, source) &&
+        ReadStreamFile(stream_path, source_size, source_time, mesh);
+}
+
+// Mapped chunks of every streamed mesh, most recently used first.
+struct GeometryCache {
+    std::mutex mutex;
+    std::list<std::pair<StreamedMesh*, int>> recent;
+    size_t bytes = 0;
+};
+
+GeometryCache geometryCache;
+std::atomic<long long> streamChunkLoads{ 0 };
+
+// True when a mapped chunk can be traversed safely: children come after
+// their parent and within the chunk, no leaf is deeper than BVH_MAX_DEPTH,
+// and every leaf and lane points at one of its packets.
+bool ValidChunk(const MappedChunk& mapped, const StreamChunk& record) {
+    std::vector<int> depth(record.node_count, 0);
+    for (uint32_t i = 0; i < record.node_count; i++) {
+        const BvhNode& node = mapped.nodes[i];
+        if (node.count > 0) {
+            if (node.first < 0 || static_cast<uint32_t>(node.first) >= record.packet_count) {
+                return false;
+            }
+            continue;
+        }
+        if (node.count < 0 || node.first <= static_cast<int>(i) ||
+            static_cast<uint32_t>(node.first) + 1 >= record.node_count || depth[i] + 1 >= BVH_MAX_DEPTH) {
+            return false;
+        }
+        depth[node.first] = max(depth[node.first], depth[i] + 1);
+        depth[node.first + 1] = max(depth[node.first + 1], depth[i] + 1);
+    }
+    for (uint32_t p = 0; p < record.packet_count; p++) {
+        for (int lane : mapped.packets[p].triangle) {
+            if (lane < -1 || (lane >= 0 && static_cast<uint64_t>(lane) >= 4ull * record.packet_count)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Returns the mapping of a chunk, mapping and validating it first when
+// needed, or null when it cannot be mapped or is corrupt. Two threads racing for one chunk both map it and
+// the later view is dropped. An evicted view stays mapped until the rays
+// tracing through it let go, so GEOMETRY_CACHE_BYTES is exceeded by at most
+// one chunk per render thread.
+std::shared_ptr<const MappedChunk> AcquireChunk(StreamedMesh& mesh, int chunk) {
+    {
+        std::lock_guard<std::mutex> lock(geometryCache.mutex);
+        if (mesh.resident[chunk]) {
+            geometryCache.recent.splice(geometryCache.recent.begin(), geometryCache.recent, mesh.position[chunk]);
+            return mesh.resident[chunk];
+        }
+    }
+
+    const StreamChunk& record = mesh.chunks[chunk];
+    auto mapped = std::make_shared<MappedChunk>();
+    mapped->bytes = ChunkBytes(record);
+    mapped->view = MapViewOfFile(mesh.mapping, FILE_MAP_READ,
+        static_cast<DWORD>(record.offset >> 32), static_cast<DWORD>(record.offset), mapped->bytes);
+    if (mapped->view == nullptr) {
+        return nullptr;
+    }
+    mapped->nodes = static_cast<const BvhNode*>(mapped->view);
+    mapped->packets = reinterpret_cast<const TrianglePacket*>(mapped->nodes + record.node_count);
+    if (!ValidChunk(*mapped, record)) {
+        return nullptr;
+    }
+    streamChunkLoads++;
+
+    std::lock_guard<std::mutex> lock(geometryCache.mutex);
+    if (mesh.resident[chunk]) {
+        geometryCache.recent.splice(geometryCache.recent.begin(), geometryCache.recent, mesh.position[chunk]);
+        return mesh.resident[chunk];
+    }
+    mesh.resident[chunk] = mapped;
+    geometryCache.recent.push_front({ &mesh, chunk });
+    mesh.position[chunk] = geometryCache.recent.begin();
+    geometryCache.bytes += mapped->bytes;
+
+    while (geometryCache.bytes > GEOMETRY_CACHE_BYTES && geometryCache.recent.size() > 1) {
+        std::pair<StreamedMesh*, int> victim = geometryCache.recent.back();
+        geometryCache.bytes -= victim.first->resident[victim.second]->bytes;
+        victim.first->resident[victim.second].reset();
+        geometryCache.recent.pop_back();
+    }
+    return mapped;
+}
+
+StreamedMesh::~StreamedMesh() {
+    {
+        std::lock_guard<std::mutex> lock(geometryCache.mutex);
+        for (size_t chunk = 0; chunk < resident.size(); chunk++) {
+            if (resident[chunk]) {
+                geometryCache.bytes -= resident[chunk]->bytes;
+                geometryCache.recent.erase(position[chunk]);
+            }
+        }
+        resident.clear();
+    }
+    if (mapping != nullptr) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+
+// Built in WinMain once any meshes named on the command line are loaded.
+// Declared after geometryCache, which its streamed meshes still use while
+// being destroyed.
+Scene activeScene;
+
+// =============================================================================
+//                            Ray tracing routines
+// =============================================================================
+
+// Converts 2D canvas coordinates to 3D viewport coordinates.
+Vector3 CanvasToViewport(int x, int y) {
+    return {
+        x * VIEWPORT_SIZE / CANVAS_WIDTH,
+        y * VIEWPORT_SIZE / CANVAS_HEIGHT,
+        PROJECTION_PLANE_Z
+    };
+}
+
+// Same as above for a sub-pixel position on the canvas.
+Vector3 CanvasToViewport(float x, float y) {
+    return {
+        x * VIEWPORT_SIZE / CANVAS_WIDTH,
+        y * VIEWPORT_SIZE / CANVAS_HEIGHT,
+        PROJECTION_PLANE_Z
+    };
+}
+
+// Computes the intersection of a ray and a sphere. Returns the values
+// of t for the intersections, INFINITY for both when the ray misses.
+void IntersectRaySphere(const Vector3& origin, const Vector3& direction,
+    const SphereShape& sphere, float& t1, float& t2) {
+    Vector3 oc = Subtract(origin, sphere.center);
+
+    float k1 = DotProduct(direction, direction);
+    float k2 = 2 * DotProduct(oc, direction);
+    float k3 = DotProduct(oc, oc) - sphere.radius * sphere.radius;
+
+    float discriminant = k2 * k2 - 4 * k1 * k3;
+    if (discriminant < 0) {
+        t1 = t2 = INFINITY;
+        return;
+    }
+
+    float sqrt_discriminant = std::sqrt(discriminant);
+    t1 = (-k2 + sqrt_discriminant) / (2 * k1);
+    t2 = (-k2 - sqrt_discriminant) / (2 * k1);
+}
+
+// Computes the intersection of a ray and a plane, a single divide.
+// Returns INFINITY when the ray runs parallel to it.
+float IntersectRayPlane(const Vector3& origin, const Vector3& direction,
+    float normal_x, float normal_y, float normal_z, float offset) {
+    float denominator = normal_x * direction.x + normal_y * direction.y + normal_z * direction.z;
+    if (denominator == 0) {
+        return INFINITY;
+    }
+    return (offset - (normal_x * origin.x + normal_y * origin.y + normal_z * origin.z)) / denominator;
+}
+
+struct Intersection {
+    float t;
+    int object_id; // see Scene, -1 when nothing was hit
+    int primitive; // box: slab axis the hit face is on, mesh: triangle index, streamed: packet lane
+    int part; // instance: sphere index, or spheres.size() + mesh index; streamed: chunk
+};
+
+// Per-ray constants of the watertight ray/triangle test (Woop, Benthin and
+// Wald 2013): the ray is sheared so it runs along +z, and the 2D edge
+// functions of every triangle are evaluated in that space.
+struct WatertightRay {
+    int kx, ky, kz;
+    float shear_x, shear_y, shear_z;
+};
+
+WatertightRay PrepareWatertightRay(const Vector3& direction) {
+    float d[3] = { direction.x, direction.y, direction.z };
+    int kz = std::fabs(d[0]) > std::fabs(d[1])
+        ? (std::fabs(d[0]) > std::fabs(d[2]) ? 0 : 2)
+        : (std::fabs(d[1]) > std::fabs(d[2]) ? 1 : 2);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (d[kz] < 0) {
+        std::swap(kx, ky); // keep the winding
+    }
+    return { kx, ky, kz, d[kx] / d[kz], d[ky] / d[kz], 1.f / d[kz] };
+}
+
+// Tests four triangles at once. Updates closest_t and closest_triangle when a
+// lane is hit within (min_t, closest_t).
+void IntersectTrianglePacket(const TrianglePacket& packet, const Vector3& origin,
+    const WatertightRay& ray, float min_t, float& closest_t, int& closest_triangle) {
+    float o[3] = { origin.x, origin.y, origin.z };
+
+    __m128 az = _mm_sub_ps(_mm_load_ps(packet.v0[ray.kz]), _mm_set1_ps(o[ray.kz]));
+    __m128 bz = _mm_sub_ps(_mm_load_ps(packet.v1[ray.kz]), _mm_set1_ps(o[ray.kz]));
+    __m128 cz = _mm_sub_ps(_mm_load_ps(packet.v2[ray.kz]), _mm_set1_ps(o[ray.kz]));
+
+    __m128 sx = _mm_set1_ps(ray.shear_x);
+    __m128 sy = _mm_set1_ps(ray.shear_y);
+    __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.v0[ray.kx]), _mm_set1_ps(o[ray.kx])), _mm_mul_ps(sx, az));
+    __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.v0[ray.ky]), _mm_set1_ps(o[ray.ky])), _mm_mul_ps(sy, az));
+    __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.v1[ray.kx]), _mm_set1_ps(o[ray.kx])), _mm_mul_ps(sx, bz));
+    __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.v1[ray.ky]), _mm_set1_ps(o[ray.ky])), _mm_mul_ps(sy, bz));
+    __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.v2[ray.kx]), _mm_set1_ps(o[ray.kx])), _mm_mul_ps(sx, cz));
+    __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(packet.v2[ray.ky]), _mm_set1_ps(o[ray.ky])), _mm_mul_ps(sy, cz));
+
+    // 2D edge functions of the sheared triangle.
+    alignas(16) float u[4], v[4], w[4];
+    _mm_store_ps(u, _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx)));
+    _mm_store_ps(v, _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx)));
+    _mm_store_ps(w, _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax)));
+
+    // An exact zero means the ray grazes an edge or vertex; redo those lanes
+    // in double so neighbouring triangles agree and no ray slips through.
+    for (int lane = 0; lane < 4; lane++) {
+        if (packet.triangle[lane] >= 0 && (u[lane] == 0 || v[lane] == 0 || w[lane] == 0)) {
+            alignas(16) float lx[3][4], ly[3][4];
+            _mm_store_ps(lx[0], ax); _mm_store_ps(ly[0], ay);
+            _mm_store_ps(lx[1], bx); _mm_store_ps(ly[1], by);
+            _mm_store_ps(lx[2], cx); _mm_store_ps(ly[2], cy);
+            u[lane] = static_cast<float>(static_cast<double>(lx[2][lane]) * ly[1][lane] - static_cast<double>(ly[2][lane]) * lx[1][lane]);
+            v[lane] = static_cast<float>(static_cast<double>(lx[0][lane]) * ly[2][lane] - static_cast<double>(ly[0][lane]) * lx[2][lane]);
+            w[lane] = static_cast<float>(static_cast<double>(lx[1][lane]) * ly[0][lane] - static_cast<double>(ly[1][lane]) * lx[0][lane]);
+        }
+    }
+
+    __m128 mu = _mm_load_ps(u);
+    __m128 mv = _mm_load_ps(v);
+    __m128 mw = _mm_load_ps(w);
+    __m128 zero = _mm_setzero_ps();
+
+    // Inside when all three edge functions agree in sign, either winding.
+    __m128 any_negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(mu, zero), _mm_cmplt_ps(mv, zero)), _mm_cmplt_ps(mw, zero));
+    __m128 any_positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(mu, zero), _mm_cmpgt_ps(mv, zero)), _mm_cmpgt_ps(mw, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(mu, mv), mw);
+    __m128 miss = _mm_or_ps(_mm_and_ps(any_negative, any_positive), _mm_cmpeq_ps(det, zero));
+
+    __m128 sz = _mm_set1_ps(ray.shear_z);
+    __m128 numerator = _mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(mu, _mm_mul_ps(sz, az)),
+        _mm_mul_ps(mv, _mm_mul_ps(sz, bz))),
+        _mm_mul_ps(mw, _mm_mul_ps(sz, cz)));
+    __m128 t = _mm_div_ps(numerator, det);
+
+    __m128 in_range = _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(min_t)), _mm_cmplt_ps(t, _mm_set1_ps(closest_t)));
+    int hits = _mm_movemask_ps(_mm_andnot_ps(miss, in_range));
+    if (hits == 0) {
+        return;
+    }
+
+    alignas(16) float lane_t[4];
+    _mm_store_ps(lane_t, t);
+    for (int lane = 0; lane < 4; lane++) {
+        if ((hits & (1 << lane)) && packet.triangle[lane] >= 0 && lane_t[lane] < closest_t) {
+            closest_t = lane_t[lane];
+            closest_triangle = packet.triangle[lane];
+        }
+    }
+}
+
+// Slab test of a ray against a node's bounds. Returns the entry distance,
+// or INFINITY when the box is missed or lies outside [min_t, max_t].
+float IntersectRayAabb(const Aabb& box, const Vector3& origin, const Vector3& inv_direction,
+    float min_t, float max_t) {
+    float tx1 = (box.min_corner.x - origin.x) * inv_direction.x, tx2 = (box.max_corner.x - origin.x) * inv_direction.x;
+    float ty1 = (box.min_corner.y - origin.y) * inv_direction.y, ty2 = (box.max_corner.y - origin.y) * inv_direction.y;
+    float tz1 = (box.min_corner.z - origin.z) * inv_direction.z, tz2 = (box.max_corner.z - origin.z) * inv_direction.z;
+
+    float t_near = max(max(min(tx1, tx2), min(ty1, ty2)), max(min(tz1, tz2), min_t));
+    float t_far = min(min(max(tx1, tx2), max(ty1, ty2)), min(max(tz1, tz2), max_t));
+    return t_near <= t_far ? t_near : INFINITY;
+}
+
+// Walks a BVH front to back, calling visit_leaf(node) for every leaf the ray
+// enters before closest_t. visit_leaf may lower closest_t to cull the rest.
+template <typename LeafFn>
+void TraverseBvh(const BvhNode* nodes, const Vector3& origin, const Vector3& inv_direction,
+    float min_t, const float& closest_t, LeafFn visit_leaf) {
+    if (IntersectRayAabb(nodes[0].bounds, origin, inv_direction, min_t, closest_t) == INFINITY) {
+        return;
+    }
+
+    int stack[BVH_MAX_DEPTH];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+        const BvhNode& node = nodes[stack[--stack_size]];
+
+        if (node.count > 0) {
+            visit_leaf(node);
+            continue;
+        }
+
+        float t_left = IntersectRayAabb(nodes[node.first].bounds, origin, inv_direction, min_t, closest_t);
+        float t_right = IntersectRayAabb(nodes[node.first + 1].bounds, origin, inv_direction, min_t, closest_t);
+
+        // Push the farther child first so the nearer one is visited next.
+        if (t_left <= t_right) {
+            if (t_right != INFINITY) stack[stack_size++] = node.first + 1;
+            if (t_left != INFINITY) stack[stack_size++] = node.first;
+        }
+        else {
+            if (t_left != INFINITY) stack[stack_size++] = node.first;
+            if (t_right != INFINITY) stack[stack_size++] = node.first + 1;
+        }
+    }
+}
+
+template <typename LeafFn>
+void TraverseBvh(const Bvh& bvh, const Vector3& origin, const Vector3& inv_direction,
+    float min_t, const float& closest_t, LeafFn visit_leaf) {
+    TraverseBvh(bvh.nodes.data(), origin, inv_direction, min_t, closest_t, visit_leaf);
+}
+
+// Returns the hit triangle or -1, closest_t is lowered to its distance.
+int IntersectRayMesh(const MeshAccel& mesh, const Vector3& origin, const Vector3& direction,
+    float min_t, float& closest_t) {
+    Vector3 inv_direction = { 1.f / direction.x, 1.f / direction.y, 1.f / direction.z };
+    WatertightRay ray = PrepareWatertightRay(direction);
+    int closest_triangle = -1;
+
+    TraverseBvh(mesh.bvh, origin, inv_direction, min_t, closest_t, [&](const BvhNode& leaf) {
+        IntersectTrianglePacket(mesh.packets[leaf.first], origin, ray, min_t, closest_t, closest_triangle);
+    });
+
+    return closest_triangle;
+}
+
+// Intersects a geometry set with a ray in its local space. Returns the hit
+// part (see Intersection) or -1; triangle is set for mesh parts.
+int IntersectRayGeometry(const GeometryAccel& geometry, const Vector3& origin, const Vector3& direction,
+    float min_t, float& closest_t, int& triangle) {
+    Vector3 inv_direction = { 1.f / direction.x, 1.f / direction.y, 1.f / direction.z };
+    int part = -1;
+
+    TraverseBvh(geometry.sphere_bvh, origin, inv_direction, min_t, closest_t, [&](const BvhNode& leaf) {
+        for (int k = leaf.first; k < leaf.first + leaf.count; k++) {
+            int i = geometry.sphere_bvh.prim_indices[k];
+            float t1, t2;
+            IntersectRaySphere(origin, direction, geometry.spheres[i], t1, t2);
+            float t = min_t < t2 && t2 < t1 ? t2 : t1; // nearer root past min_t
+            if (min_t < t && t < closest_t) {
+                closest_t = t;
+                part = i;
+            }
+        }
+    });
+
+    for (size_t m = 0; m < geometry.meshes.size(); m++) {
+        int hit = IntersectRayMesh(geometry.meshes[m], origin, direction, min_t, closest_t);
+        if (hit >= 0) {
+            part = static_cast<int>(geometry.spheres.size() + m);
+            triangle = hit;
+        }
+    }
+
+    return part;
+}
+
+// Returns the hit lane (packet * 4 + lane) of a streamed chunk or -1,
+// closest_t is lowered to its distance.
+int IntersectRayChunk(const MappedChunk& chunk, const Vector3& origin, const Vector3& inv_direction,
+    const WatertightRay& ray, float min_t, float& closest_t) {
+    int closest_lane = -1;
+    TraverseBvh(chunk.nodes, origin, inv_direction, min_t, closest_t, [&](const BvhNode& leaf) {
+        IntersectTrianglePacket(chunk.packets[leaf.first], origin, ray, min_t, closest_t, closest_lane);
+    });
+    return closest_lane;
+}
+
+// Intersects the streamed meshes one ray at a time, mapping chunks as the
+// ray enters them front to back.
+void IntersectRayStreamed(const Scene& scene, const Vector3& origin, const Vector3& direction,
+    float min_t, float max_t, Intersection& closest) {
+    if (scene.streamed.empty()) {
+        return;
+    }
+    Vector3 inv_direction = { 1.f / direction.x, 1.f / direction.y, 1.f / direction.z };
+    WatertightRay ray = PrepareWatertightRay(direction);
+
+    for (size_t m = 0; m < scene.streamed.size(); m++) {
+        StreamedMesh& mesh = *scene.streamed[m];
+        TraverseBvh(mesh.chunk_bvh, origin, inv_direction, min_t, closest.t, [&](const BvhNode& leaf) {
+            int chunk = mesh.chunk_bvh.prim_indices[leaf.first];
+            std::shared_ptr<const MappedChunk> mapped = AcquireChunk(mesh, chunk);
+            if (mapped == nullptr) {
+                return;
+            }
+            int lane = IntersectRayChunk(*mapped, origin, inv_direction, ray, min_t, closest.t);
+            if (lane >= 0 && closest.t < max_t) {
+                closest.object_id = scene.StreamBase() + static_cast<int>(m);
+                closest.primitive = lane;
+                closest.part = chunk;
+            }
+        });
+    }
+}
+
+// Finds the closest object hit by the ray within [min_t, max_t], leaving
+// out the streamed meshes.
+bool ClosestResidentIntersection(const Vector3& origin, const Vector3& direction,
+    float min_t, float max_t, const Scene& scene, Intersection& closest) {
+    closest.t = INFINITY;
+    closest.object_id = -1;
+    closest.primitive = 0;
+    closest.part = -1;
+
+    for (size_t i = 0; i < scene.spheres.size(); i++) {
+        float t1, t2;
+        IntersectRaySphere(origin, direction, scene.spheres[i], t1, t2);
+
+        if (t1 < closest.t && min_t < t1 && t1 < max_t) {
+            closest.t = t1;
+            closest.object_id = static_cast<int>(i);
+        }
+        if (t2 < closest.t && min_t < t2 && t2 < max_t) {
+            closest.t = t2;
+            closest.object_id = static_cast<int>(i);
+        }
+    }
+
+    const PlaneArrays& planes = scene.planes;
+    for (size_t i = 0; i < planes.offset.size(); i++) {
+        float t = IntersectRayPlane(origin, direction,
+            planes.normal_x[i], planes.normal_y[i], planes.normal_z[i], planes.offset[i]);
+
+        if (t < closest.t && min_t < t && t < max_t) {
+            closest.t = t;
+            closest.object_id = scene.PlaneBase() + static_cast<int>(i);
+        }
+    }
+
+    // Slab test; the reciprocals are shared by all boxes.
+    const BoxArrays& boxes = scene.boxes;
+    const float inv_x = 1.f / direction.x;
+    const float inv_y = 1.f / direction.y;
+    const float inv_z = 1.f / direction.z;
+
+    for (size_t i = 0; i < boxes.min_x.size(); i++) {
+        float tx1 = (boxes.min_x[i] - origin.x) * inv_x, tx2 = (boxes.max_x[i] - origin.x) * inv_x;
+        float ty1 = (boxes.min_y[i] - origin.y) * inv_y, ty2 = (boxes.max_y[i] - origin.y) * inv_y;
+        float tz1 = (boxes.min_z[i] - origin.z) * inv_z, tz2 = (boxes.max_z[i] - origin.z) * inv_z;
+
+        float near_x = min(tx1, tx2), near_y = min(ty1, ty2), near_z = min(tz1, tz2);
+        float far_x = max(tx1, tx2), far_y = max(ty1, ty2), far_z = max(tz1, tz2);
+        float t_near = max(near_x, max(near_y, near_z));
+        float t_far = min(far_x, min(far_y, far_z));
+
+        if (t_near > t_far) {
+            continue;
+        }
+
+        // From inside the box the exit face is the visible one.
+        bool entering = min_t < t_near;
+        float t = entering ? t_near : t_far;
+        if (t < closest.t && min_t < t && t < max_t) {
+            closest.t = t;
+            closest.object_id = scene.BoxBase() + static_cast<int>(i);
+            if (entering) {
+                closest.primitive = t_near == near_x ? 0 : (t_near == near_y ? 1 : 2);
+            }
+            else {
+                closest.primitive = t_far == far_x ? 0 : (t_far == far_y ? 1 : 2);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < scene.meshes.size(); i++) {
+        int triangle = IntersectRayMesh(scene.meshes[i], origin, direction, min_t, closest.t);
+        if (triangle >= 0 && closest.t < max_t) {
+            closest.object_id = scene.MeshBase() + static_cast<int>(i);
+            closest.primitive = triangle;
+        }
+    }
+
+    // Instances: the ray is taken into each instance's space untouched in
+    // length, so the local t is the world t.
+    if (!scene.instances.empty()) {
+        Vector3 inv_direction = { inv_x, inv_y, inv_z };
+        TraverseBvh(scene.instance_bvh, origin, inv_direction, min_t, closest.t, [&](const BvhNode& leaf) {
+            for (int k = leaf.first; k < leaf.first + leaf.count; k++) {
+                int i = scene.instance_bvh.prim_indices[k];
+                const Instance& instance = scene.instances[i];
+                const Matrix3& inverse = scene.instance_inverse[i];
+
+                Vector3 local_origin = MultiplyMV(inverse, Subtract(origin, instance.translation));
+                Vector3 local_direction = MultiplyMV(inverse, direction);
+                int triangle = 0;
+                int part = IntersectRayGeometry(scene.geometries[instance.geometry],
+                    local_origin, local_direction, min_t, closest.t, triangle);
+
+                if (part >= 0 && closest.t < max_t) {
+                    closest.object_id = scene.InstanceBase() + i;
+                    closest.primitive = triangle;
+                    closest.part = part;
+                }
+            }
+        });
+    }
+
+    return closest.object_id >= 0 && closest.t < max_t;
+}
+
+// Finds the closest object hit by the ray within [min_t, max_t]. When
+// known_hit is given it is that hit, already found by IntersectPrimaryBatch.
+bool ClosestIntersection(const Vector3& origin, const Vector3& direction,
+    float min_t, float max_t, const Scene& scene, Intersection& closest,
+    const Intersection* known_hit = nullptr) {
+    if (known_hit != nullptr) {
+        closest = *known_hit;
+    }
+    else {
+        ClosestResidentIntersection(origin, direction, min_t, max_t, scene, closest);
+        IntersectRayStreamed(scene, origin, direction, min_t, max_t, closest);
+    }
+    return closest.object_id >= 0 && closest.t < max_t;
+}
+
+// Closest hits of a batch of rays from one origin with the whole scene. The
+// resident objects are intersected first, so chunks behind their hits are
+// never mapped. The streamed meshes are then taken chunk by chunk instead of
+// ray by ray: every ray lists the chunks it enters before its hit, nearest
+// first. Each round queues every unfinished ray on the next
+// chunk it needs, sorts the queue by chunk and maps each queued chunk once
+// for all its rays. A ray is done when its hit is nearer than the next chunk.
+void IntersectPrimaryBatch(const Scene& scene, const Vector3& origin, const std::vector<Vector3>& directions,
+    float min_t, std::vector<Intersection>& hits) {
+    TRACE_ZONE("IntersectPrimaryBatch");
+
+    struct ChunkEntry {
+        float t;
+        uint32_t mesh;
+        uint32_t chunk;
+    };
+    std::vector<ChunkEntry> entries;
+    std::vector<size_t> next(directions.size() + 1); // per ray, its first unvisited entry
+    hits.resize(directions.size());
+
+    for (size_t i = 0; i < directions.size(); i++) {
+        ClosestResidentIntersection(origin, directions[i], min_t, INFINITY, scene, hits[i]);
+        next[i] = entries.size();
+        Vector3 inv_direction = { 1.f / directions[i].x, 1.f / directions[i].y, 1.f / directions[i].z };
+        for (size_t m = 0; m < scene.streamed.size(); m++) {
+            const Bvh& chunk_bvh = scene.streamed[m]->chunk_bvh;
+            TraverseBvh(chunk_bvh, origin, inv_direction, min_t, hits[i].t, [&](const BvhNode& leaf) {
+                entries.push_back({ IntersectRayAabb(leaf.bounds, origin, inv_direction, min_t, hits[i].t),
+                    static_cast<uint32_t>(m), static_cast<uint32_t>(chunk_bvh.prim_indices[leaf.first]) });
+            });
+        }
+        std::sort(entries.begin() + next[i], entries.end(),
+            [](const ChunkEntry& a, const ChunkEntry& b) { return a.t < b.t; });
+    }
+    next[directions.size()] = entries.size();
+    std::vector<size_t> end(next.begin() + 1, next.end());
+
+    std::vector<std::pair<uint64_t, uint32_t>> queue; // (mesh << 32 | chunk, ray)
+    while (true) {
+        queue.clear();
+        for (size_t i = 0; i < directions.size(); i++) {
+            if (next[i] < end[i] && entries[next[i]].t < hits[i].t) {
+                const ChunkEntry& entry = entries[next[i]];
+                queue.push_back({ static_cast<uint64_t>(entry.mesh) << 32 | entry.chunk, static_cast<uint32_t>(i) });
+            }
+        }
+        if (queue.empty()) {
+            break;
+        }
+        std::sort(queue.begin(), queue.end());
+
+        for (size_t q = 0; q < queue.size();) {
+            int m = static_cast<int>(queue[q].first >> 32);
+            int chunk = static_cast<int>(queue[q].first & 0xffffffff);
+            std::shared_ptr<const MappedChunk> mapped = AcquireChunk(*scene.streamed[m], chunk);
+
+            for (; q < queue.size() && queue[q].first == (static_cast<uint64_t>(m) << 32 | static_cast<uint32_t>(chunk)); q++) {
+                uint32_t i = queue[q].second;
+                next[i]++;
+                if (mapped == nullptr) {
+                    continue;
+                }
+                const Vector3& direction = directions[i];
+                Vector3 inv_direction = { 1.f / direction.x, 1.f / direction.y, 1.f / direction.z };
+                int lane = IntersectRayChunk(*mapped, origin, inv_direction, PrepareWatertightRay(direction),
+                    min_t, hits[i].t);
+                if (lane >= 0) {
+                    hits[i].object_id = scene.StreamBase() + m;
+                    hits[i].primitive = lane;
+                    hits[i].part = chunk;
+                }
+            }
+        }
+    }
+}
+
+// Geometric normal of a mesh triangle, not normalized.
+Vector3 TriangleNormal(const MeshAccel& mesh, int triangle) {
+    const int* tri = &mesh.indices[3 * triangle];
+    Vector3 e1 = Subtract(mesh.vertices[tri[1]], mesh.vertices[tri[0]]);
+    Vector3 e2 = Subtract(mesh.vertices[tri[2]], mesh.vertices[tri[0]]);
+    return { e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x };
+}
+
+// Geometric normal of a triangle of a streamed mesh, not normalized. Its
+// chunk is mapped again if it was evicted since the hit.
+Vector3 StreamedTriangleNormal(StreamedMesh& mesh, int chunk, int lane_code) {
+    std::shared_ptr<const MappedChunk> mapped = AcquireChunk(mesh, chunk);
+    if (mapped == nullptr) {
+        return { 0.f, 1.f, 0.f };
+    }
+    const TrianglePacket& packet = mapped->packets[lane_code / 4];
+    int lane = lane_code % 4;
+    Vector3 v0 = { packet.v0[0][lane], packet.v0[1][lane], packet.v0[2][lane] };
+    Vector3 v1 = { packet.v1[0][lane], packet.v1[1][lane], packet.v1[2][lane] };
+    Vector3 v2 = { packet.v2[0][lane], packet.v2[1][lane], packet.v2[2][lane] };
+    return CrossProduct(Subtract(v1, v0), Subtract(v2, v0));
+}
+
+// Unit surface normal at a hit point. Box and triangle normals face against the ray.
+Vector3 HitNormal(const Scene& scene, const Vector3& point, const Vector3& direction,
+    const Intersection& hit) {
+    if (hit.object_id >= scene.StreamBase()) {
+        Vector3 normal = StreamedTriangleNormal(*scene.streamed[hit.object_id - scene.StreamBase()], hit.part, hit.primitive);
+        normal = Multiply(1.f / Length(normal), normal);
+        return DotProduct(normal, direction) > 0 ? Multiply(-1.f, normal) : normal;
+    }
+
+    if (hit.object_id >= scene.InstanceBase()) {
+        int i = hit.object_id - scene.InstanceBase();
+        const Instance& instance = scene.instances[i];
+        const GeometryAccel& geometry = scene.geometries[instance.geometry];
+        const Matrix3& inverse = scene.instance_inverse[i];
+
+        Vector3 local_normal;
+        if (hit.part < static_cast<int>(geometry.spheres.size())) {
+            Vector3 local_point = MultiplyMV(inverse, Subtract(point, instance.translation));
+            local_normal = Subtract(local_point, geometry.spheres[hit.part].center);
+        }
+        else {
+            local_normal = TriangleNormal(geometry.meshes[hit.part - geometry.spheres.size()], hit.primitive);
+        }
+
+        // Normals transform by the inverse transpose.
+        Vector3 normal = MultiplyMTV(inverse, local_normal);
+        normal = Multiply(1.f / Length(normal), normal);
+        return DotProduct(normal, direction) > 0 ? Multiply(-1.f, normal) : normal;
+    }
+
+    if (hit.object_id < scene.PlaneBase()) {
+        const SphereShape& sphere = scene.spheres[hit.object_id];
+        Vector3 normal = Subtract(point, sphere.center);
+        return Multiply(1.f / Length(normal), normal);
+    }
+
+    if (hit.object_id < scene.BoxBase()) {
+        int i = hit.object_id - scene.PlaneBase();
+        return { scene.planes.normal_x[i], scene.planes.normal_y[i], scene.planes.normal_z[i] };
+    }
+
+    if (hit.object_id >= scene.MeshBase()) {
+        Vector3 normal = TriangleNormal(scene.meshes[hit.object_id - scene.MeshBase()], hit.primitive);
+        normal = Multiply(1.f / Length(normal), normal);
+        return DotProduct(normal, direction) > 0 ? Multiply(-1.f, normal) : normal;
+    }
+
+    float axis_direction[3] = { direction.x, direction.y, direction.z };
+    Vector3 normal = { 0.f, 0.f, 0.f };
+    float sign = axis_direction[hit.primitive] > 0 ? -1.f : 1.f;
+    if (hit.primitive == 0) normal.x = sign;
+    else if (hit.primitive == 1) normal.y = sign;
+    else normal.z = sign;
+    return normal;
+}
+
+// Index into scene.materials of the object that was hit.
+int HitMaterial(const Scene& scene, const Intersection& hit) {
+    int object_id = hit.object_id;
+    if (object_id < scene.PlaneBase()) {
+        return scene.spheres[object_id].material;
+    }
+    if (object_id < scene.BoxBase()) {
+        return scene.planes.material[object_id - scene.PlaneBase()];
+    }
+    if (object_id < scene.MeshBase()) {
+        return scene.boxes.material[object_id - scene.BoxBase()];
+    }
+    if (object_id < scene.InstanceBase()) {
+        return scene.meshes[object_id - scene.MeshBase()].material;
+    }
+    if (object_id >= scene.StreamBase()) {
+        return scene.streamed[object_id - scene.StreamBase()]->material;
+    }
+
+    const GeometryAccel& geometry = scene.geometries[scene.instances[object_id - scene.InstanceBase()].geometry];
+    if (hit.part < static_cast<int>(geometry.spheres.size())) {
+        return geometry.spheres[hit.part].material;
+    }
+    return geometry.meshes[hit.part - geometry.spheres.size()].material;
+}
+
+const Material& GetSurface(const Scene& scene, const Intersection& hit) {
+    return scene.materials[HitMaterial(scene, hit)];
+}
+
+// Width of a primary ray's pixel cone per unit of distance travelled.
+const float PIXEL_SPREAD_ANGLE = VIEWPORT_SIZE / CANVAS_WIDTH / PROJECTION_PLANE_Z;
+
+// Texture coordinates of a hit, in repeats of a texture `scale` world units
+// across, and how many repeats one world unit spans there. Spheres get a
+// latitude/longitude map with a whole number of repeats around; everything
+// else is projected along the dominant axis of its normal.
+void HitTextureCoordinates(const Scene& scene, const Intersection& hit, const Vector3& point,
+    const Vector3& normal, float scale, float& s, float& t, float& density) {
+    if (hit.object_id < scene.PlaneBase()) {
+        const float pi = 3.14159265f;
+        float radius = scene.spheres[hit.object_id].radius;
+        float around = max(1.f, std::round(2 * pi * radius / scale));
+        float down = max(1.f, std::round(pi * radius / scale));
+        s = (std::atan2(normal.z, normal.x) / (2 * pi) + 0.5f) * around;
+        t = std::acos(min(1.f, max(-1.f, normal.y))) / pi * down;
+        density = max(around / (2 * pi), down / pi) / radius;
+        return;
+    }
+
+    float ax = std::abs(normal.x), ay = std::abs(normal.y), az = std::abs(normal.z);
+    if (ax >= ay && ax >= az) {
+        s = point.z / scale;
+        t = point.y / scale;
+    }
+    else if (ay >= az) {
+        s = point.x / scale;
+        t = point.z / scale;
+    }
+    else {
+        s = point.x / scale;
+        t = point.y / scale;
+    }
+    density = 1.f / scale;
+}
+
+// Specular terms below 2^SPECULAR_CUTOFF_LOG2 cannot move an 8-bit channel
+// and are dropped.
+const float SPECULAR_CUTOFF_LOG2 = -10.f;
+const int SPECULAR_SQUARING_MAX = 8;
+
+// base^exponent for base in [0, 1], standing in for std::pow in the specular
+// term. Exponents up to SPECULAR_SQUARING_MAX use repeated squaring. Larger
+// ones evaluate exponent * log2(base) and its exp2 with polynomials on the
+// float's mantissa and exponent fields, within 1e-3 relative error; there is
+// no branch on the base and no denormal intermediate.
+float SpecularPow(float base, int exponent) {
+    if (base < 1.f / 1024.f) {
+        return 0.f; // base^exponent <= base, already below the cutoff
+    }
+
+    if (exponent <= SPECULAR_SQUARING_MAX) {
+        float result = 1.f;
+        float square = base;
+        while (exponent > 1) {
+            if (exponent & 1) {
+                result *= square;
+            }
+            square *= square;
+            exponent >>= 1;
+        }
+        return exponent == 1 ? result * square : result;
+    }
+
+    // log2(base) = e + log2(m), m in [1, 2).
+    uint32_t bits;
+    std::memcpy(&bits, &base, sizeof(bits));
+    float e = static_cast<float>(static_cast<int>(bits >> 23) - 127);
+    bits = (bits & 0x007FFFFFu) | 0x3F800000u;
+    float m;
+    std::memcpy(&m, &bits, sizeof(m));
+    float x = m - 1.f;
+    float log2_m = x * (1.4425449f + x * (-0.7181452f + x * (0.4575485f +
+        x * (-0.2779042f + x * (0.1217970f + x * -0.0258411f)))));
+
+    float y = exponent * (e + log2_m);
+    bool invisible = y < SPECULAR_CUTOFF_LOG2;
+    y = max(y, SPECULAR_CUTOFF_LOG2);
+
+    // exp2(y) = 2^floor(y) * 2^fraction.
+    int whole = static_cast<int>(y);
+    whole -= y < static_cast<float>(whole);
+    float f = y - whole;
+    float exp2_f = 1.f + f * (0.6931472f + f * (0.2402265f + f * (0.0555041f +
+        f * (0.0096181f + f * 0.0013333f))));
+    uint32_t scale_bits = static_cast<uint32_t>(whole + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &scale_bits, sizeof(scale));
+
+    return invisible ? 0.f : exp2_f * scale;
+}
+
+// Diffuse and specular light arriving along vec_l, ignoring occluders.
+float SurfaceResponse(const Vector3& normal, const Vector3& view, int specular,
+    const Vector3& vec_l, float light_intensity) {
+    float intensity = 0.f;
+    float length_n = Length(normal); // Should be 1.0, but just in case...
+
+    // Diffuse reflection.
+    float n_dot_l = DotProduct(normal, vec_l);
+    if (n_dot_l > 0) {
+        intensity += light_intensity * n_dot_l / (length_n * Length(vec_l));
+    }
+
+    // Specular reflection.
+    if (specular != -1) {
+        Vector3 vec_r = ReflectRayDirection(vec_l, normal);
+        float r_dot_v = DotProduct(vec_r, view);
+        if (r_dot_v > 0) {
+            intensity += light_intensity * SpecularPow(r_dot_v / (Length(vec_r) * Length(view)), specular);
+        }
+    }
+
+    return intensity;
+}
+
+// Diffuse and specular light arriving along vec_l, including the shadow check.
+float LightContribution(const Vector3& point, const Vector3& normal, const Vector3& view,
+    int specular, const Scene& scene, const Vector3& vec_l, float t_max, float light_intensity) {
+    // Shadow check.
+    Intersection shadow_hit;
+    if (ClosestIntersection(point, vec_l, EPSILON, t_max, scene, shadow_hit)) {
+        return 0.f;
+    }
+    return SurfaceResponse(normal, view, specular, vec_l, light_intensity);
+}
+
+// Point on an area light for (u, v) in [0, 1)^2. A sphere is sampled over
+// the disk through its center facing point, which is what point sees of it
+// unless it is very close. At the center itself no disk faces point, so the
+// center is returned.
+Vector3 AreaLightSample(const Light& light, const Vector3& point, float u, float v) {
+    if (light.ltype == LightType::RECTANGLE) {
+        return Add(light.position, Add(Multiply(u - 0.5f, light.edge_u), Multiply(v - 0.5f, light.edge_v)));
+    }
+
+    // Concentric square-to-disk mapping, which keeps the strata compact.
+    const float quarter_pi = 0.785398163f;
+    float a = 2.f * u - 1.f, b = 2.f * v - 1.f;
+    float r = 0.f, phi = 0.f;
+    if (std::abs(a) > std::abs(b)) {
+        r = a;
+        phi = quarter_pi * b / a;
+    }
+    else if (b != 0.f) {
+        r = b;
+        phi = 2.f * quarter_pi - quarter_pi * a / b;
+    }
+
+    Vector3 w = Subtract(light.position, point);
+    float distance = Length(w);
+    if (distance == 0.f) {
+        return light.position;
+    }
+    w = Multiply(1.f / distance, w);
+    Vector3 helper = std::abs(w.x) > 0.9f ? Vector3{ 0.f, 1.f, 0.f } : Vector3{ 1.f, 0.f, 0.f };
+    Vector3 axis_u = CrossProduct(helper, w);
+    axis_u = Multiply(1.f / Length(axis_u), axis_u);
+    Vector3 axis_v = CrossProduct(w, axis_u);
+
+    float radius = light.radius * r;
+    return Add(light.position, Add(Multiply(radius * std::cos(phi), axis_u), Multiply(radius * std::sin(phi), axis_v)));
+}
+
+// Soft shadow from a sphere or rectangle light: one jittered shadow ray per
+// cell of an AREA_LIGHT_GRID x AREA_LIGHT_GRID grid over the light. One cell
+// per quadrant goes first; when those four rays agree the point is fully lit
+// or in umbra and they are the estimate, so only penumbra points trace the
+// rest and the cost follows the penumbra area.
+float AreaLightContribution(const Vector3& point, const Vector3& normal, const Vector3& view,
+    int specular, const Scene& scene, const Light& light, int light_index) {
+    const int half = AREA_LIGHT_GRID / 2;
+    const int cells = AREA_LIGHT_GRID * AREA_LIGHT_GRID;
+    uint32_t bits[3];
+    std::memcpy(bits, &point, sizeof(bits));
+    auto random = [&](int counter) {
+        return Philox4x32({ bits[0], bits[1], bits[2], static_cast<uint32_t>(light_index * (cells + 1) + counter) },
+            { samplingFrame, RNG_STREAM_AREA_LIGHT });
+    };
+
+    float sum = 0.f;
+    int samples = 0, visible = 0;
+    auto trace_cell = [&](int quadrant, int sub) {
+        int col = (quadrant % 2) * half + sub % half;
+        int row = (quadrant / 2) * half + sub / half;
+        std::array<uint32_t, 4> jitter = random(row * AREA_LIGHT_GRID + col);
+        Vector3 vec_l = Subtract(AreaLightSample(light, point,
+            (col + UnitFloat(jitter[0])) / AREA_LIGHT_GRID, (row + UnitFloat(jitter[1])) / AREA_LIGHT_GRID), point);
+
+        samples++;
+        Intersection shadow_hit;
+        if (Length(vec_l) == 0.f) {
+            visible++; // on the light itself, nothing can occlude it
+        }
+        else if (!ClosestIntersection(point, vec_l, EPSILON, 1.f, scene, shadow_hit)) {
+            visible++;
+            sum += SurfaceResponse(normal, view, specular, vec_l, light.intensity);
+        }
+    };
+
+    // The cell tried first in each quadrant varies from point to point.
+    std::array<uint32_t, 4> first = random(cells);
+    for (int quadrant = 0; quadrant < 4; quadrant++) {
+        trace_cell(quadrant, first[quadrant] % (half * half));
+    }
+    if (visible != 0 && visible != samples) {
+        for (int quadrant = 0; quadrant < 4; quadrant++) {
+            for (int sub = 0; sub < half * half; sub++) {
+                if (sub != static_cast<int>(first[quadrant] % (half * half))) {
+                    trace_cell(quadrant, sub);
+                }
+            }
+        }
+    }
+
+    return sum / samples;
+}
+
+// Uniform number in [0, 1) keyed by a shading point and a sample index.
+float PointJitter(const Vector3& point, int sample) {
+    uint32_t bits[3];
+    std::memcpy(bits, &point, sizeof(bits));
+    return UnitFloat(Philox4x32({ bits[0], bits[1], bits[2], static_cast<uint32_t>(sample) },
+        { samplingFrame, RNG_STREAM_LIGHT })[0]);
+}
+
+// Bounds, over the lights of a tree node, of the cosine they arrive at and
+// of the angle the node's box spans from point. Both are 0 when the whole box
+// lies behind the surface.
+void LightNodeBounds(const LightTree& tree, int node_index, const Vector3& point,
+    const Vector3& normal, float& cos_bound, float& spread) {
+    const Aabb& box = tree.bvh.nodes[node_index].bounds;
+    cos_bound = spread = 0.f;
+
+    // Largest dot(normal, corner - point) over the box.
+    float max_dot = 0.f;
+    float nearest_squared = 0.f;
+    for (int axis = 0; axis < 3; axis++) {
+        float lo = AxisOf(box.min_corner, axis) - AxisOf(point, axis);
+        float hi = AxisOf(box.max_corner, axis) - AxisOf(point, axis);
+        float n = AxisOf(normal, axis);
+        max_dot += n > 0 ? n * hi : n * lo;
+        float gap = lo > 0 ? lo : (hi < 0 ? hi : 0.f);
+        nearest_squared += gap * gap;
+    }
+    if (max_dot <= 0) {
+        return;
+    }
+
+    float nearest = std::sqrt(nearest_squared);
+    float diagonal = Length(Subtract(box.max_corner, box.min_corner));
+    cos_bound = nearest > max_dot ? max_dot / nearest : 1.f;
+    spread = nearest > diagonal ? diagonal / nearest : 1.f;
+}
+
+// Lightcut: refines the tree from the root, always splitting the cluster
+// with the largest intensity * cos * spread, until LIGHT_CUT_SIZE clusters
+// are in the cut. Each is shaded as its representative light carrying the
+// whole cluster's intensity.
+float EvaluateLightCut(const Vector3& point, const Vector3& normal, const Vector3& view,
+    int specular, const Scene& scene) {
+    const LightTree& tree = scene.light_tree;
+    int cut[LIGHT_CUT_SIZE];
+    float error[LIGHT_CUT_SIZE];
+    int cut_size = 0;
+
+    auto add_to_cut = [&](int node_index) {
+        float cos_bound, spread;
+        LightNodeBounds(tree, node_index, point, normal, cos_bound, spread);
+        if (cos_bound > 0) {
+            cut[cut_size] = node_index;
+            error[cut_size] = tree.intensity[node_index] * cos_bound * spread;
+            cut_size++;
+        }
+    };
+
+    add_to_cut(0);
+    while (cut_size + 1 <= LIGHT_CUT_SIZE) {
+        int worst = -1;
+        for (int i = 0; i < cut_size; i++) {
+            if (tree.bvh.nodes[cut[i]].count == 0 && (worst < 0 || error[i] > error[worst])) {
+                worst = i;
+            }
+        }
+        if (worst < 0) {
+            break; // only single lights left
+        }
+
+        int first_child = tree.bvh.nodes[cut[worst]].first;
+        cut_size--;
+        cut[worst] = cut[cut_size];
+        error[worst] = error[cut_size];
+        add_to_cut(first_child);
+        add_to_cut(first_child + 1);
+    }
+
+    float intensity = 0.f;
+    for (int i = 0; i < cut_size; i++) {
+        const Light& light = tree.lights[tree.representative[cut[i]]];
+        intensity += LightContribution(point, normal, view, specular, scene,
+            Subtract(light.position, point), 1.f, tree.intensity[cut[i]]);
+    }
+    return intensity;
+}
+
+// Estimate from LIGHT_SAMPLES lights, each picked by walking down the tree
+// and divided by the probability of picking it. Lights behind the surface
+// are never picked, so the estimate is unbiased for the diffuse term only:
+// the specular SurfaceResponse adds for them is missing.
+float SampleLightTree(const Vector3& point, const Vector3& normal, const Vector3& view,
+    int specular, const Scene& scene) {
+    const LightTree& tree = scene.light_tree;
+    float intensity = 0.f;
+    int dimension = 0;
+
+    for (int sample = 0; sample < LIGHT_SAMPLES; sample++) {
+        int node_index = 0;
+        float pdf = 1.f;
+
+        while (pdf > 0 && tree.bvh.nodes[node_index].count == 0) {
+            int first_child = tree.bvh.nodes[node_index].first;
+            float weight[2];
+            for (int c = 0; c < 2; c++) {
+                float cos_bound, spread;
+                LightNodeBounds(tree, first_child + c, point, normal, cos_bound, spread);
+                weight[c] = tree.intensity[first_child + c] * cos_bound;
+            }
+
+            float total = weight[0] + weight[1];
+            if (total <= 0) {
+                pdf = 0.f;
+                break;
+            }
+            int pick = PointJitter(point, dimension++) * total < weight[0] ? 0 : 1;
+            pdf *= weight[pick] / total;
+            node_index = first_child + pick;
+        }
+
+        if (pdf > 0) {
+            const Light& light = tree.lights[tree.representative[node_index]];
+            intensity += LightContribution(point, normal, view, specular, scene,
+                Subtract(light.position, point), 1.f, light.intensity / (pdf * LIGHT_SAMPLES));
+        }
+    }
+
+    return intensity;
+}
+
+// Computes the light intensity at a point, including shadows and specular highlights.
+float ComputeLighting(const Vector3& point, const Vector3& normal, const Vector3& view,
+    int specular, const Scene& scene) {
+    float intensity = 0.f;
+
+    for (const Light& light : scene.lights) {
+        if (light.ltype == LightType::AMBIENT) {
+            intensity += light.intensity;
+            continue;
+        }
+
+        if (light.ltype == LightType::POINT) {
+            intensity += LightContribution(point, normal, view, specular, scene,
+                Subtract(light.position, point), 1.f, light.intensity);
+        }
+        else if (light.ltype == LightType::SPHERE || light.ltype == LightType::RECTANGLE) {
+            intensity += AreaLightContribution(point, normal, view, specular, scene, light,
+                static_cast<int>(&light - scene.lights.data()));
+        }
+        else { // LightType::DIRECTIONAL
+            intensity += LightContribution(point, normal, view, specular, scene,
+                light.position, INFINITY, light.intensity);
+        }
+    }
+
+    if (!scene.light_tree.lights.empty()) {
+        intensity += LIGHT_SAMPLING_STOCHASTIC
+            ? SampleLightTree(point, normal, view, specular, scene)
+            : EvaluateLightCut(point, normal, view, specular, scene);
+    }
+
+    return intensity;
+}
+
+// Traces a ray against the objects in the scene. When hit is not null
+// it receives the closest intersection of this ray (not of its reflections).
+// cone_width is the width of the ray's pixel cone at origin, which picks the
+// texture filter footprint; it is 0 at the eye. known_hit is passed on to
+// ClosestIntersection.
+Color TraceRay(const Vector3& origin, const Vector3& direction, float min_t, float max_t,
+    const Scene& scene, int recursion_depth, RayHit* hit, float cone_width = 0.f,
+    const Intersection* known_hit = nullptr) {
+    Intersection closest;
+    bool found = ClosestIntersection(origin, direction, min_t, max_t, scene, closest, known_hit);
+
+    if (hit != nullptr) {
+        hit->object_id = closest.object_id;
+        hit->t = closest.t;
+    }
+
+    if (!found) {
+        return BACKGROUND_COLOR;
+    }
+
+    Vector3 point = Add(origin, Multiply(closest.t, direction));
+    Vector3 normal = HitNormal(scene, point, direction, closest);
+    const Material& surface = GetSurface(scene, closest);
+    float footprint = cone_width + closest.t * Length(direction) * PIXEL_SPREAD_ANGLE;
+
+    Color color = surface.color;
+    if (surface.texture >= 0 && scene.textures[surface.texture] != nullptr) {
+        const SampledTexture& texture = *scene.textures[surface.texture];
+        float s, t, density;
+        HitTextureCoordinates(scene, closest, point, normal, texture.source.scale, s, t, density);
+        // A slanted surface stretches the footprint along the slant.
+        float slant = max(std::abs(DotProduct(normal, direction)) / Length(direction), 1.f / 16);
+        Color texel = SampleTexture(texture, s, t, footprint / slant * density);
+        color = { color.b * texel.b / 255, color.g * texel.g / 255, color.r * texel.r / 255 };
+    }
+
+    Vector3 view = Multiply(-1.f, direction);
+    float lighting = ComputeLighting(point, normal, view, surface.specular, scene);
+    Color local_color = Multiply(lighting, color);
+
+    float reflective = surface.reflective;
+    if (recursion_depth <= 0 || reflective <= 0) {
+        return local_color;
+    }
+
+    Vector3 reflected_ray = ReflectRayDirection(view, normal);
+    Color reflected_color = TraceRay(point, reflected_ray, EPSILON, INFINITY,
+        scene, recursion_depth - 1, nullptr, footprint);
+
+    return Add(Multiply(1 - reflective, local_color), Multiply(reflective, reflected_color));
+}
+
+
+void Interpolate(int i0, int d0, int i1, int d1, std::vector<float>& ds) {
+    if (i0 == i1) {
+        ds.push_back(static_cast<float>(d0));
+    }
+
+    float a = static_cast<float>(d1 - d0) / (i1 - i0);
+    float d = static_cast<float>(d0);
+
+    for (int i = i0; i <= i1; i++) {
+        ds.push_back(d);
+        d += a;
+    }
+}
+
+void DrawLine(const PointOnCanvas& p0, const PointOnCanvas& p1, const Color& color) {
+    int dx = p1.x - p0.x;
+    int dy = p1.y - p0.y;
+    std::vector<float> ds;
+
+    if (std::abs(dx) > std::abs(dy)) {
+        // The line is horizontal-ish. Make sure it's left to right.
+        if (dx < 0) {
+            auto swap = p0;
+            const_cast<PointOnCanvas&>(p0) = p1;
+            const_cast<PointOnCanvas&>(p1) = swap;
+        }
+
+        // Compute the Y values and draw.
+        Interpolate(p0.x, p0.y, p1.x, p1.y, ds);
+
+        for (int x = p0.x; x <= p1.x; x++) {
+            PutPixel(x, static_cast<int>(ds[(x - p0.x) | 0]), color);
+        }
+    }
+    else {
+        // The line is verical-ish. Make sure it's bottom to top.
+        if (dy < 0) {
+            auto swap = p0;
+            const_cast<PointOnCanvas&>(p0) = p1;
+            const_cast<PointOnCanvas&>(p1) = swap;
+        }
+
+        // Compute the X values and draw.
+        Interpolate(p0.y, p0.x, p1.y, p1.x, ds);
+
+        for (int y = p0.y; y <= p1.y; y++) {
+            PutPixel(static_cast<int>(ds[(y - p0.y) | 0]), y, color);
+        }
+    }
+}
+
+void DrawWireframeTriangle(const PointOnCanvas& p0, const PointOnCanvas& p1, const PointOnCanvas& p2, const Color& color) {
+    DrawLine(p0, p1, color);
+    DrawLine(p1, p2, color);
+    DrawLine(p0, p2, color);
+}
+
+
+// Projects a mesh through the camera and draws its edges. Triangles with a
+// vertex behind the camera or far off-canvas are skipped rather than clipped.
+void DrawMeshWireframe(const TriangleMesh& mesh, const Matrix3& camera_rotation,
+    const Vector3& camera_position, const Color& color) {
+    auto project = [&](int index, int& x, int& y) {
+        Vector3 view = MultiplyMTV(camera_rotation, Subtract(mesh.vertices[index], camera_position));
+        if (view.z <= EPSILON) {
+            return false;
+        }
+        float px = view.x * PROJECTION_PLANE_Z / view.z * CANVAS_WIDTH / VIEWPORT_SIZE;
+        float py = view.y * PROJECTION_PLANE_Z / view.z * CANVAS_HEIGHT / VIEWPORT_SIZE;
+        if (std::fabs(px) > 4 * CANVAS_WIDTH || std::fabs(py) > 4 * CANVAS_HEIGHT) {
+            return false;
+        }
+        x = static_cast<int>(px);
+        y = static_cast<int>(py);
+        return true;
+    };
+
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        int x0, y0, x1, y1, x2, y2;
+        if (project(mesh.indices[i], x0, y0) && project(mesh.indices[i + 1], x1, y1) &&
+            project(mesh.indices[i + 2], x2, y2)) {
+            DrawWireframeTriangle(PointOnCanvas(x0, y0), PointOnCanvas(x1, y1), PointOnCanvas(x2, y2), color);
+        }
+    }
+}
+
+
+void DrawFilledTriangle(const PointOnCanvas& p0, const PointOnCanvas& p1, const PointOnCanvas& p2, const Color& color) {
+    // Sort the points from bottom to top.
+    if (p1.y < p0.y) {
+        auto swap = p0;
+        const_cast<PointOnCanvas&>(p0) = p1;
+        const_cast<PointOnCanvas&>(p1) = swap;
+    }
+    if (p2.y < p0.y) {
+        auto swap = p0;
+        const_cast<PointOnCanvas&>(p0) = p2;
+        const_cast<PointOnCanvas&>(p2) = swap;
+    }
+    if (p2.y < p1.y) {
+        auto swap = p1;
+        const_cast<PointOnCanvas&>(p1) = p2;
+        const_cast<PointOnCanvas&>(p2) = swap;
+    }
+
+    std::vector<float> x01;
+    std::vector<float> x12;
+    std::vector<float> x02;
+
+    // Compute X coordinates of the edges.
+    Interpolate(p0.y, p0.x, p1.y, p1.x, x01);
+    Interpolate(p1.y, p1.x, p2.y, p2.x, x12);
+    Interpolate(p0.y, p0.x, p2.y, p2.x, x01);
 
     // Merge the two short sides.
     x01.pop_back();
     x01.insert(x01.end(), x12.begin(), x12.end());
 
-    // Determine which is left and which is right.
-    std::vector<float> *x_left, *x_right;
-    int m = (x02.size() / 2);
-    if (x02[m] < x01[m]) {
-        x_left = &x02;
-        x_right = &x01;
+    // Determine which is left and which is right.
+    std::vector<float> *x_left, *x_right;
+    int m = (x02.size() / 2);
+    if (x02[m] < x01[m]) {
+        x_left = &x02;
+        x_right = &x01;
+    }
+    else {
+        x_left = &x01;
+        x_right = &x02;
+    }
+
+    // Draw horizontal segments.
+    for (int y = p0.y; y <= p2.y; y++) {
+        for (int x = static_cast<int>((*x_left)[y - p0.y]); x <= static_cast<int>((*x_right)[y - p0.y]); x++) {
+            PutPixel(x, y, color);
+        }
+    }
+}
+
+
+void RenderSection(int start_y, int end_y, const Scene& scene,
+    const Matrix3& camera_rotation, const Vector3& camera_position, unsigned generation) {
+    TRACE_ZONE("RenderSection");
+
+    std::vector<Vector3> band_directions;
+    std::vector<Intersection> primary_hits;
+    for (int band_y = start_y; band_y < end_y && !FrameCancelled(generation); band_y += STREAM_BATCH_ROWS) {
+        int band_end = min(band_y + STREAM_BATCH_ROWS, end_y);
+
+        // Primary hits are found for the whole band first, so streamed
+        // meshes are intersected a chunk at a time rather than by each
+        // primary ray on its own.
+        if (!scene.streamed.empty()) {
+            band_directions.clear();
+            for (int y = band_y; y < band_end; ++y) {
+                for (int x = -CANVAS_WIDTH / 2; x < CANVAS_WIDTH / 2; ++x) {
+                    band_directions.push_back(MultiplyMV(camera_rotation, CanvasToViewport(x, y)));
+                }
+            }
+            IntersectPrimaryBatch(scene, camera_position, band_directions, 1, primary_hits);
+        }
+
+        for (int y = band_y; y < band_end && !FrameCancelled(generation); ++y) {
+            for (int x = -CANVAS_WIDTH / 2; x < CANVAS_WIDTH / 2; ++x) {
+                Vector3 direction = CanvasToViewport(x, y);
+                direction = MultiplyMV(camera_rotation, direction);
+
+                const Intersection* primary_hit = scene.streamed.empty() ? nullptr
+                    : &primary_hits[(y - band_y) * CANVAS_WIDTH + x + CANVAS_WIDTH / 2];
+                RayHit hit;
+                Color color = TraceRay(camera_position, direction, 1, INFINITY,
+                    scene, RECURSION_DEPTH, &hit, 0.f, primary_hit);
+
+                PutPixel(x, y, Clamp(color));
+
+                int offset = CanvasOffset(x, y);
+                if (offset >= 0) {
+                    objectIdBuffer[offset] = hit.object_id;
+                }
+            }
+        }
+    }
+}
+
+// True when the pixel differs from one of its 4 neighbours in object ID or
+// by more than AA_CONTRAST_THRESHOLD in any channel of the single-sample pass.
+bool IsEdgePixel(int x, int y) {
+    int offset = CanvasOffset(x, y);
+    if (offset < 0) {
+        return false;
+    }
+
+    DWORD c = aaSourceBuffer[offset];
+    const int neighbours[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+
+    for (const auto& n : neighbours) {
+        int n_offset = CanvasOffset(x + n[0], y + n[1]);
+        if (n_offset < 0) {
+            continue;
+        }
+        if (objectIdBuffer[n_offset] != objectIdBuffer[offset]) {
+            return true;
+        }
+
+        DWORD nc = aaSourceBuffer[n_offset];
+        if (static_cast<unsigned>(std::abs(GetRValue(c) - GetRValue(nc))) > AA_CONTRAST_THRESHOLD ||
+            static_cast<unsigned>(std::abs(GetGValue(c) - GetGValue(nc))) > AA_CONTRAST_THRESHOLD ||
+            static_cast<unsigned>(std::abs(GetBValue(c) - GetBValue(nc))) > AA_CONTRAST_THRESHOLD) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Second AA pass: supersamples the edge pixels of a section and leaves the
+// rest of the single-sample result untouched.
+void ResolveSectionAA(int start_y, int end_y, const Scene& scene,
+    const Matrix3& camera_rotation, const Vector3& camera_position, unsigned generation) {
+    TRACE_ZONE("ResolveSectionAA");
+
+    const float stratum = 1.f / AA_GRID;
+    int edge_pixels = 0;
+
+    for (int y = start_y; y < end_y && !FrameCancelled(generation); ++y) {
+        for (int x = -CANVAS_WIDTH / 2; x < CANVAS_WIDTH / 2; ++x) {
+            if (!IsEdgePixel(x, y)) {
+                continue;
+            }
+
+            unsigned b = 0, g = 0, r = 0;
+            for (int sy = 0; sy < AA_GRID; sy++) {
+                for (int sx = 0; sx < AA_GRID; sx++) {
+                    std::array<float, 4> jitter = PixelRandom(x, y, sy * AA_GRID + sx);
+                    float px = x - 0.5f + (sx + jitter[0]) * stratum;
+                    float py = y - 0.5f + (sy + jitter[1]) * stratum;
+
+                    Vector3 direction = MultiplyMV(camera_rotation, CanvasToViewport(px, py));
+                    Color color = Clamp(TraceRay(camera_position, direction, 1, INFINITY,
+                        scene, RECURSION_DEPTH, nullptr));
+
+                    b += color.b;
+                    g += color.g;
+                    r += color.r;
+                }
+            }
+
+            const unsigned n = AA_GRID * AA_GRID;
+            PutPixel(x, y, Color(b / n, g / n, r / n));
+            edge_pixels++;
+        }
+    }
+
+    aaEdgePixels += edge_pixels;
+}
+
+// Splits rows [first_y, last_y) of the canvas into horizontal sections, runs
+// section_fn(start_y, end_y) for each on its own thread and waits for all of them.
+template <typename SectionFn>
+void ForEachSection(std::vector<std::thread>& threads, SectionFn section_fn,
+    int first_y = -CANVAS_HEIGHT / 2, int last_y = CANVAS_HEIGHT / 2) {
+    unsigned int num_threads = static_cast<unsigned int>(threads.size());
+    int section_width = (last_y - first_y) / static_cast<int>(num_threads);
+
+    // Create threads to render sections of the canvas
+    for (unsigned int i = 0; i < num_threads; ++i) {
+        int start_y = first_y + i * section_width;
+        int end_y = first_y + (i + 1) * section_width;
+        if (i == num_threads - 1) {
+            end_y = last_y;
+        }
+
+        threads[i] = std::thread([=] {
+            TraceSetThread(i + 1);
+            section_fn(start_y, end_y);
+        });
+    }
+
+    // Join threads
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Renders rows [start_y, end_y) of a frame. Edge detection for AA looks at
+// the neighbouring rows, so the single-sample pass covers one more row on
+// each side; those rows are put back afterwards as they may already hold
+// the final pixels of another band. Returns false when the frame was cancelled.
+bool RenderRows(std::vector<std::thread>& threads, const Scene& scene, const Matrix3& camera_rotation,
+    const Vector3& camera_position, unsigned generation, bool antialias, int start_y, int end_y) {
+    int first_y = antialias ? max(start_y - 1, -CANVAS_HEIGHT / 2) : start_y;
+    int last_y = antialias ? min(end_y + 1, CANVAS_HEIGHT / 2) : end_y;
+    std::vector<std::pair<int, std::vector<DWORD>>> margins;
+    for (int y : { first_y, last_y - 1 }) {
+        int offset = CanvasOffset(-CANVAS_WIDTH / 2, y);
+        if ((y < start_y || y >= end_y) && offset >= 0) {
+            margins.push_back({ offset, { canvasBuffer.begin() + offset, canvasBuffer.begin() + offset + CANVAS_WIDTH } });
+        }
+    }
+
+    ForEachSection(threads, [&](int section_start, int section_end) {
+        RenderSection(section_start, section_end, scene, camera_rotation, camera_position, generation);
+    }, first_y, last_y);
+
+    if (antialias && !FrameCancelled(generation)) {
+        // Edge pixels read their neighbours, so the single-sample pass must be
+        // complete and frozen before any section starts overwriting it.
+        aaSourceBuffer = canvasBuffer;
+        aaEdgePixels = 0;
+
+        ForEachSection(threads, [&](int section_start, int section_end) {
+            ResolveSectionAA(section_start, section_end, scene, camera_rotation, camera_position, generation);
+        }, start_y, end_y);
+    }
+
+    for (const auto& margin : margins) {
+        std::copy(margin.second.begin(), margin.second.end(), canvasBuffer.begin() + margin.first);
+    }
+    return !FrameCancelled(generation);
+}
+
+// Renders a whole frame. Returns false when it was cancelled, in which case
+// the canvas holds a partial frame that should not be presented.
+bool RenderFrame(std::vector<std::thread>& threads, const Scene& scene, const Matrix3& camera_rotation,
+    const Vector3& camera_position, unsigned generation, bool antialias = ADAPTIVE_AA) {
+    TRACE_ZONE("Frame");
+    return RenderRows(threads, scene, camera_rotation, camera_position, generation, antialias,
+        -CANVAS_HEIGHT / 2, CANVAS_HEIGHT / 2);
+}
+
+// =============================================================================
+//                           Progressive refinement
+// =============================================================================
+
+struct ProgressiveStats {
+    long long preview_ms;
+    long long total_ms;
+    int passes;
+};
+
+// A pixel belongs to the level of the coarsest grid it lies on, so each pixel
+// gets its first sample exactly once across the levels.
+bool InRefinementLevel(int col, int row, int step) {
+    if (col % step != 0 || row % step != 0) {
+        return false;
+    }
+    return step == PROGRESSIVE_COARSEST || col % (2 * step) != 0 || row % (2 * step) != 0;
+}
+
+// Runs one pass over a tile. step > 0 is a refinement level whose pixels take
+// their first (centered) sample and paint their still-empty step x step block;
+// step == 0 adds jittered sample number `sample` to every pixel.
+void RefineTile(int tile_col, int tile_row, int step, int sample,
+    const Scene& scene, const Matrix3& camera_rotation, const Vector3& camera_position) {
+    int col_end = min(tile_col + PROGRESSIVE_TILE, CANVAS_WIDTH);
+    int row_end = min(tile_row + PROGRESSIVE_TILE, CANVAS_HEIGHT);
+
+    for (int row = tile_row; row < row_end; row++) {
+        for (int col = tile_col; col < col_end; col++) {
+            if (step > 0 && !InRefinementLevel(col, row, step)) {
+                continue;
+            }
+
+            float x = static_cast<float>(col - CANVAS_WIDTH / 2);
+            float y = static_cast<float>(CANVAS_HEIGHT / 2 - row);
+            if (step == 0) {
+                std::array<float, 4> jitter = PixelRandom(col, row, sample);
+                x += jitter[0] - 0.5f;
+                y += jitter[1] - 0.5f;
+            }
+
+            Vector3 direction = MultiplyMV(camera_rotation, CanvasToViewport(x, y));
+            Color color = Clamp(TraceRay(camera_position, direction, 1, INFINITY,
+                scene, RECURSION_DEPTH, nullptr));
+
+            int offset = col + CANVAS_WIDTH * row;
+            AccumPixel& acc = accumBuffer[offset];
+            acc.b += color.b;
+            acc.g += color.g;
+            acc.r += color.r;
+            acc.samples++;
+
+            DWORD value = RGB(acc.b / acc.samples, acc.g / acc.samples, acc.r / acc.samples);
+            canvasBuffer[offset] = value;
+
+            // Preview fill for the pixels a finer level has not reached yet.
+            for (int fr = row; step > 1 && fr < min(row + step, row_end); fr++) {
+                for (int fc = col; fc < min(col + step, col_end); fc++) {
+                    if (accumBuffer[fc + CANVAS_WIDTH * fr].samples == 0) {
+                        canvasBuffer[fc + CANVAS_WIDTH * fr] = value;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Checkpoint file: header, then accumBuffer. Sample jitter is PixelRandom
+// of pixel and sample number, so the pass index is all the sampler state a
+// resumed render needs to continue the same sequence.
+const char CHECKPOINT_MAGIC[4] = { 'R', 'T', 'C', 'P' };
+const uint32_t CHECKPOINT_VERSION = 1;
+
+struct CheckpointHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t width, height;
+    int32_t next_pass;
+    int32_t total_passes;
+    uint64_t fingerprint; // scene and camera the samples belong to
+};
+
+// FNV-1a over what decides the image, so a checkpoint is not resumed into a
+// different scene or view. Structs are hashed field by field so their
+// padding never enters the hash.
+uint64_t CheckpointFingerprint(const Scene& scene, const Matrix3& camera_rotation, const Vector3& camera_position) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](const void* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ static_cast<const unsigned char*>(data)[i]) * 1099511628211ull;
+        }
+    };
+    auto mix_value = [&](auto value) { mix(&value, sizeof(value)); };
+    auto mix_vector = [&](const Vector3& v) { mix_value(v.x); mix_value(v.y); mix_value(v.z); };
+    auto mix_floats = [&](const std::vector<float>& values) { mix(values.data(), values.size() * sizeof(float)); };
+    auto mix_ints = [&](const std::vector<int>& values) { mix(values.data(), values.size() * sizeof(int)); };
+    auto mix_color = [&](const Color& color) { mix_value(color.b); mix_value(color.g); mix_value(color.r); };
+    auto mix_spheres = [&](const std::vector<SphereShape>& spheres) {
+        for (const SphereShape& sphere : spheres) {
+            mix_vector(sphere.center);
+            mix_value(sphere.radius);
+            mix_value(sphere.material);
+        }
+    };
+    auto mix_mesh = [&](const MeshAccel& mesh) {
+        mix_value(mesh.vertices.size());
+        for (const Vector3& vertex : mesh.vertices) {
+            mix_vector(vertex);
+        }
+        mix_value(mesh.indices.size());
+        mix_ints(mesh.indices);
+        mix_value(mesh.material);
+    };
+    auto mix_lights = [&](const std::vector<Light>& lights) {
+        for (const Light& light : lights) {
+            mix_value(static_cast<int>(light.ltype));
+            mix_value(light.intensity);
+            mix_vector(light.position);
+            mix_value(light.radius);
+            mix_vector(light.edge_u);
+            mix_vector(light.edge_v);
+        }
+    };
+
+    uint64_t counts[] = { scene.materials.size(), static_cast<uint64_t>(scene.InstanceBase()),
+        scene.instances.size(), scene.streamed.size(), scene.lights.size(), scene.light_tree.lights.size(),
+        scene.geometries.size(), scene.textures.size() };
+    mix(counts, sizeof(counts));
+
+    for (const Material& material : scene.materials) {
+        mix_color(material.color);
+        mix_value(material.specular);
+        mix_value(material.reflective);
+        mix_value(material.texture);
+    }
+    mix_spheres(scene.spheres);
+    for (const std::vector<float>* values : { &scene.planes.normal_x, &scene.planes.normal_y,
+        &scene.planes.normal_z, &scene.planes.offset, &scene.boxes.min_x, &scene.boxes.min_y,
+        &scene.boxes.min_z, &scene.boxes.max_x, &scene.boxes.max_y, &scene.boxes.max_z }) {
+        mix_floats(*values);
+    }
+    mix_ints(scene.planes.material);
+    mix_ints(scene.boxes.material);
+    for (const MeshAccel& mesh : scene.meshes) {
+        mix_mesh(mesh);
+    }
+    for (const GeometryAccel& geometry : scene.geometries) {
+        mix_value(geometry.spheres.size());
+        mix_spheres(geometry.spheres);
+        mix_value(geometry.meshes.size());
+        for (const MeshAccel& mesh : geometry.meshes) {
+            mix_mesh(mesh);
+        }
+    }
+    for (const Instance& instance : scene.instances) {
+        mix_value(instance.geometry);
+        mix(instance.transform.matrix_buf.data(), instance.transform.matrix_buf.size() * sizeof(float));
+        mix_vector(instance.translation);
+    }
+    for (const std::shared_ptr<StreamedMesh>& mesh : scene.streamed) {
+        mix_value(mesh->chunks.size());
+        for (const StreamChunk& chunk : mesh->chunks) {
+            mix_vector(chunk.bounds.min_corner);
+            mix_vector(chunk.bounds.max_corner);
+            mix_value(chunk.node_count);
+            mix_value(chunk.packet_count);
+        }
+        mix_value(mesh->material);
+    }
+    mix_lights(scene.lights);
+    mix_lights(scene.light_tree.lights);
+    for (const std::shared_ptr<const SampledTexture>& texture : scene.textures) {
+        mix_value(texture != nullptr);
+        if (texture != nullptr) {
+            mix_value(static_cast<int>(texture->source.kind));
+            mix_value(texture->source.scale);
+            mix_value(texture->source.path.size());
+            mix(texture->source.path.data(), texture->source.path.size());
+            mix_color(texture->source.color_a);
+            mix_color(texture->source.color_b);
+        }
+    }
+
+    mix(camera_rotation.matrix_buf.data(), camera_rotation.matrix_buf.size() * sizeof(float));
+    mix_vector(camera_position);
+    return hash;
+}
+
+// Writes to a temporary file first, so a crash mid-write leaves the previous
+// checkpoint intact.
+bool WriteCheckpoint(const std::string& path, CheckpointHeader header, std::vector<AccumPixel> accum) {
+    std::string temp_path = path + ".tmp";
+    {
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(accum.data()), accum.size() * sizeof(AccumPixel));
+        if (!out) {
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+    return !error;
+}
+
+// Loads a checkpoint into accumBuffer. Returns the pass to continue from,
+// or -1 when the file is missing or belongs to another render.
+int ReadCheckpoint(const std::string& path, uint64_t fingerprint, int total_passes) {
+    std::ifstream in(path, std::ios::binary);
+    CheckpointHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CHECKPOINT_VERSION || header.width != CANVAS_WIDTH ||
+        header.height != CANVAS_HEIGHT || header.total_passes != total_passes ||
+        header.fingerprint != fingerprint || header.next_pass < 1 || header.next_pass > total_passes) {
+        return -1;
+    }
+
+    std::vector<AccumPixel> accum(CANVAS_WIDTH * CANVAS_HEIGHT);
+    if (!in.read(reinterpret_cast<char*>(accum.data()), accum.size() * sizeof(AccumPixel))) {
+        return -1;
+    }
+    accumBuffer = std::move(accum);
+    return header.next_pass;
+}
+
+// Redraws the canvas from accumBuffer after a resume. Pixels no level has
+// reached yet take the preview fill of the finest level that covers them.
+void CanvasFromAccum() {
+    auto average = [](const AccumPixel& acc) {
+        return RGB(acc.b / acc.samples, acc.g / acc.samples, acc.r / acc.samples);
+    };
+
+    for (int row = 0; row < CANVAS_HEIGHT; row++) {
+        for (int col = 0; col < CANVAS_WIDTH; col++) {
+            const AccumPixel& acc = accumBuffer[col + CANVAS_WIDTH * row];
+            if (acc.samples > 0) {
+                canvasBuffer[col + CANVAS_WIDTH * row] = average(acc);
+                continue;
+            }
+            for (int step = 2; step <= PROGRESSIVE_COARSEST; step *= 2) {
+                const AccumPixel& origin = accumBuffer[col - col % step + CANVAS_WIDTH * (row - row % step)];
+                if (origin.samples > 0) {
+                    canvasBuffer[col + CANVAS_WIDTH * row] = average(origin);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void PublishCanvas(HWND hwnd) {
+    HDC hdc = GetDC(hwnd);
+    UpdateCanvas(hwnd, hdc, CANVAS_WIDTH, CANVAS_HEIGHT);
+    ReleaseDC(hwnd, hdc);
+}
+
+// Renders the frame pass by pass on the worker threads while the calling
+// thread keeps the window responsive and presents intermediate results.
+// With a checkpoint path, the accumulated samples are saved between passes
+// and, when resume is set, a matching checkpoint is continued from.
+ProgressiveStats RenderProgressive(std::vector<std::thread>& threads,
+    const Matrix3& camera_rotation, const Vector3& camera_position, HWND hwnd,
+    const std::string& checkpoint_path, bool resume) {
+    TRACE_ZONE("Frame");
+
+    auto start = std::chrono::high_resolution_clock::now();
+    ProgressiveStats stats = { 0, 0, 0 };
+    accumBuffer.assign(CANVAS_WIDTH * CANVAS_HEIGHT, { 0.f, 0.f, 0.f, 0 });
+
+    const int tiles_x = (CANVAS_WIDTH + PROGRESSIVE_TILE - 1) / PROGRESSIVE_TILE;
+    const int tiles_y = (CANVAS_HEIGHT + PROGRESSIVE_TILE - 1) / PROGRESSIVE_TILE;
+    std::vector<std::pair<int, int>> tiles;
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            tiles.push_back({ tx, ty });
+        }
+    }
+    std::sort(tiles.begin(), tiles.end(), [](const auto& a, const auto& b) {
+        return MortonEncode(a.first, a.second) < MortonEncode(b.first, b.second);
+    });
+
+    // (step, sample) per pass: the refinement levels, then the extra samples.
+    std::vector<std::pair<int, int>> passes;
+    for (int step = PROGRESSIVE_COARSEST; step >= 1; step /= 2) {
+        passes.push_back({ step, 0 });
+    }
+    for (int sample = 1; sample < PROGRESSIVE_SAMPLES; sample++) {
+        passes.push_back({ 0, sample });
+    }
+
+    uint64_t fingerprint = CheckpointFingerprint(activeScene, camera_rotation, camera_position);
+    int first_pass = resume ? ReadCheckpoint(checkpoint_path, fingerprint, static_cast<int>(passes.size())) : -1;
+    if (first_pass > 0) {
+        CanvasFromAccum();
+        PublishCanvas(hwnd);
+    }
+    else {
+        first_pass = 0;
+    }
+
+    bool quit_requested = false;
+    unsigned generation = renderGeneration.load();
+    auto last_publish = start;
+    auto last_checkpoint = start;
+    std::future<bool> checkpoint_write;
+
+    for (int p = first_pass; p < static_cast<int>(passes.size()); p++) {
+        const auto& pass = passes[p];
+        if (quit_requested) {
+            break;
+        }
+
+        std::atomic<int> next_tile{ 0 };
+        std::atomic<int> workers_done{ 0 };
+
+        for (unsigned int i = 0; i < threads.size(); ++i) {
+            threads[i] = std::thread([&, i] {
+                TraceSetThread(i + 1);
+                TRACE_ZONE("RefinePass");
+                for (int t = next_tile++; t < static_cast<int>(tiles.size()) && !FrameCancelled(generation);
+                    t = next_tile++) {
+                    RefineTile(tiles[t].first * PROGRESSIVE_TILE, tiles[t].second * PROGRESSIVE_TILE,
+                        pass.first, pass.second, activeScene, camera_rotation, camera_position);
+                }
+                workers_done++;
+            });
+        }
+
+        // Present on a fixed interval until every worker finished this pass.
+        while (workers_done < static_cast<int>(threads.size())) {
+            MSG msg;
+            while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
+                if (msg.message == WM_QUIT) {
+                    // Let the workers drop their remaining tiles.
+                    quit_requested = true;
+                    renderGeneration++;
+                    break;
+                }
+                TranslateMessage(&msg);
+                DispatchMessage(&msg);
+            }
+
+            auto now = std::chrono::high_resolution_clock::now();
+            if (now - last_publish >= PROGRESSIVE_PUBLISH_INTERVAL) {
+                PublishCanvas(hwnd);
+                last_publish = now;
+            }
+            std::this_thread::sleep_for(1ms);
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        stats.passes++;
+        if (stats.passes == 1) {
+            // The coarse level is the preview, show it without waiting.
+            PublishCanvas(hwnd);
+            last_publish = std::chrono::high_resolution_clock::now();
+            stats.preview_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                last_publish - start).count();
+        }
+
+        // Only completed passes are saved; a pass cut short by quitting is
+        // redone on resume. The snapshot is taken while the workers are idle
+        // and written on another thread. A periodic write skips its turn if
+        // the previous one is still going; the last pass waits for it
+        // instead, so the final state is always saved.
+        auto now = std::chrono::high_resolution_clock::now();
+        bool last_pass = p + 1 == static_cast<int>(passes.size());
+        bool write_due = false;
+        if (!checkpoint_path.empty() && !quit_requested) {
+            if (last_pass) {
+                if (checkpoint_write.valid()) {
+                    checkpoint_write.wait();
+                }
+                write_due = true;
+            }
+            else {
+                write_due = now - last_checkpoint >= PROGRESSIVE_CHECKPOINT_INTERVAL &&
+                    (!checkpoint_write.valid() || checkpoint_write.wait_for(0s) == std::future_status::ready);
+            }
+        }
+        if (write_due) {
+            CheckpointHeader header = { {}, CHECKPOINT_VERSION, CANVAS_WIDTH, CANVAS_HEIGHT, p + 1,
+                static_cast<int32_t>(passes.size()), fingerprint };
+            std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+            checkpoint_write = std::async(std::launch::async, WriteCheckpoint, checkpoint_path, header, accumBuffer);
+            last_checkpoint = now;
+        }
+    }
+    if (checkpoint_write.valid()) {
+        checkpoint_write.wait();
+    }
+
+    PublishCanvas(hwnd);
+    stats.total_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+
+    if (quit_requested) {
+        PostQuitMessage(0);
+    }
+
+    return stats;
+}
+
+// =============================================================================
+//                           Temporal reprojection
+// =============================================================================
+
+const int TEMPORAL_EMPTY = -2; // no sample landed here, has to be traced
+
+struct TemporalSample {
+    Vector3 position; // world-space primary hit, ray direction for background
+    float depth; // camera-space z, INFINITY for background
+    int object_id;
+    DWORD color;
+};
+
+struct TemporalStats {
+    int reused;
+    int traced;
+    bool completed;
+};
+
+std::vector<TemporalSample> temporalCache; // last frame, one entry per pixel
+std::vector<TemporalSample> temporalScratch;
+bool temporalCacheValid = false;
+unsigned temporalFrame = 0;
+
+// Projects a camera-space vector onto the canvas and rounds to the nearest
+// pixel. Returns -1 when it falls behind the camera or off the canvas.
+int ProjectToPixel(const Vector3& v) {
+    if (v.z <= 0) {
+        return -1;
+    }
+
+    float x = v.x / v.z * PROJECTION_PLANE_Z * CANVAS_WIDTH / VIEWPORT_SIZE;
+    float y = v.y / v.z * PROJECTION_PLANE_Z * CANVAS_HEIGHT / VIEWPORT_SIZE;
+    int col = static_cast<int>(std::floor(x + 0.5f)) + CANVAS_WIDTH / 2;
+    int row = CANVAS_HEIGHT / 2 - static_cast<int>(std::floor(y + 0.5f));
+
+    if (col < 0 || col >= CANVAS_WIDTH || row < 0 || row >= CANVAS_HEIGHT) {
+        return -1;
+    }
+    return col + CANVAS_WIDTH * row;
+}
+
+// Scatters last frame's samples into the new view, nearest depth wins.
+void ReprojectTemporalCache(const Matrix3& camera_rotation, const Vector3& camera_position) {
+    TRACE_ZONE("Reproject");
+
+    for (TemporalSample& sample : temporalScratch) {
+        sample.object_id = TEMPORAL_EMPTY;
+        sample.depth = INFINITY;
+    }
+
+    for (const TemporalSample& sample : temporalCache) {
+        if (sample.object_id == TEMPORAL_EMPTY) {
+            continue;
+        }
+
+        // Background samples are directions, only the rotation moves them.
+        Vector3 view = sample.object_id < 0
+            ? MultiplyMTV(camera_rotation, sample.position)
+            : MultiplyMTV(camera_rotation, Subtract(sample.position, camera_position));
+
+        int offset = ProjectToPixel(view);
+        if (offset < 0) {
+            continue;
+        }
+
+        TemporalSample& target = temporalScratch[offset];
+        float depth = sample.object_id < 0 ? INFINITY : view.z;
+        if (target.object_id == TEMPORAL_EMPTY || depth < target.depth) {
+            target = sample;
+            target.depth = depth;
+        }
+    }
+}
+
+// Forward reprojection leaves single-pixel holes where neighbouring samples
+// rounded to the same pixel. Inside a surface those are patched from the
+// closer of the two neighbours on either side instead of being traced.
+bool FillTemporalHole(int col, int row) {
+    int offset = col + CANVAS_WIDTH * row;
+    const int strides[2] = { 1, CANVAS_WIDTH };
+    bool has_neighbours[2] = {
+        col > 0 && col < CANVAS_WIDTH - 1,
+        row > 0 && row < CANVAS_HEIGHT - 1
+    };
+
+    for (int axis = 0; axis < 2; axis++) {
+        if (!has_neighbours[axis]) {
+            continue;
+        }
+
+        const TemporalSample& a = temporalScratch[offset - strides[axis]];
+        const TemporalSample& b = temporalScratch[offset + strides[axis]];
+        if (a.object_id != TEMPORAL_EMPTY && a.object_id == b.object_id) {
+            temporalScratch[offset] = a.depth <= b.depth ? a : b;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Reprojected silhouettes are unreliable, so pixels whose object differs from
+// a neighbour are traced again, as are holes and the refresh subset.
+bool NeedsRetrace(int col, int row) {
+    int offset = col + CANVAS_WIDTH * row;
+    int id = temporalScratch[offset].object_id;
+
+    if (id == TEMPORAL_EMPTY ||
+        static_cast<unsigned>(offset) % TEMPORAL_REFRESH_PERIOD == temporalFrame % TEMPORAL_REFRESH_PERIOD) {
+        return true;
+    }
+
+    // Holes are traced anyway and do not make their neighbours edges.
+    auto differs = [&](int n_offset) {
+        int n_id = temporalScratch[n_offset].object_id;
+        return n_id != TEMPORAL_EMPTY && n_id != id;
+    };
+
+    return (col > 0 && differs(offset - 1)) ||
+        (col < CANVAS_WIDTH - 1 && differs(offset + 1)) ||
+        (row > 0 && differs(offset - CANVAS_WIDTH)) ||
+        (row < CANVAS_HEIGHT - 1 && differs(offset + CANVAS_WIDTH));
+}
+
+// Renders a frame reusing the previous one where the reprojection is valid.
+TemporalStats RenderFrameTemporal(std::vector<std::thread>& threads,
+    const Matrix3& camera_rotation, const Vector3& camera_position, unsigned generation) {
+    TRACE_ZONE("Frame");
+
+    temporalCache.resize(CANVAS_WIDTH * CANVAS_HEIGHT);
+    temporalScratch.resize(CANVAS_WIDTH * CANVAS_HEIGHT);
+
+    if (temporalCacheValid) {
+        ReprojectTemporalCache(camera_rotation, camera_position);
+    }
+    else {
+        for (TemporalSample& sample : temporalScratch) {
+            sample.object_id = TEMPORAL_EMPTY;
+        }
+    }
+
+    // Decide before tracing: the neighbour test must see the reprojected
+    // buffer, not pixels another section already overwrote.
+    std::vector<unsigned char> retrace(CANVAS_WIDTH * CANVAS_HEIGHT);
+    for (int row = 0; row < CANVAS_HEIGHT; row++) {
+        for (int col = 0; col < CANVAS_WIDTH; col++) {
+            if (temporalScratch[col + CANVAS_WIDTH * row].object_id == TEMPORAL_EMPTY) {
+                FillTemporalHole(col, row);
+            }
+        }
+    }
+    for (int row = 0; row < CANVAS_HEIGHT; row++) {
+        for (int col = 0; col < CANVAS_WIDTH; col++) {
+            retrace[col + CANVAS_WIDTH * row] = NeedsRetrace(col, row);
+        }
+    }
+
+    std::atomic<int> traced{ 0 };
+
+    // Sections are given in canvas y, shift them to buffer rows.
+    ForEachSection(threads, [&](int start_y, int end_y) {
+        TRACE_ZONE("RenderSection");
+        int section_traced = 0;
+
+        for (int row = start_y + CANVAS_HEIGHT / 2;
+            row < end_y + CANVAS_HEIGHT / 2 && !FrameCancelled(generation); row++) {
+            for (int col = 0; col < CANVAS_WIDTH; col++) {
+                int offset = col + CANVAS_WIDTH * row;
+                TemporalSample& sample = temporalScratch[offset];
+
+                if (retrace[offset]) {
+                    Vector3 direction = MultiplyMV(camera_rotation, CanvasToViewport(
+                        static_cast<float>(col - CANVAS_WIDTH / 2), static_cast<float>(CANVAS_HEIGHT / 2 - row)));
+
+                    RayHit hit;
+                    Color color = Clamp(TraceRay(camera_position, direction, 1, INFINITY,
+                        activeScene, RECURSION_DEPTH, &hit));
+
+                    sample.object_id = hit.object_id;
+                    if (hit.object_id < 0) {
+                        sample.position = direction;
+                        sample.depth = INFINITY;
+                    }
+                    else {
+                        sample.position = Add(camera_position, Multiply(hit.t, direction));
+                        sample.depth = hit.t * PROJECTION_PLANE_Z;
+                    }
+                    sample.color = RGB(color.b, color.g, color.r);
+                    section_traced++;
+                }
+
+                canvasBuffer[offset] = sample.color;
+            }
+        }
+
+        traced += section_traced;
+    });
+
+    // A cancelled frame leaves the cache as it was, the next frame
+    // reprojects from the last completed one.
+    if (FrameCancelled(generation)) {
+        return { 0, traced.load(), false };
+    }
+
+    std::swap(temporalCache, temporalScratch);
+    temporalCacheValid = true;
+    temporalFrame++;
+
+    return { CANVAS_WIDTH * CANVAS_HEIGHT - traced.load(), traced.load(), true };
+}
+
+// =============================================================================
+//                             Procedural scenes
+// =============================================================================
+// Seeded generators for stress tests. Spheres go into a geometry set placed
+// by an identity instance so they sit under a BVH rather than in the linear
+// sphere list. Everything lands in a box in front of the default camera.
+
+enum class SceneKind {
+    SPHERE_GRID,
+    RANDOM_CLOUD,
+    NESTED_CLUSTERS, // reflective clusters of clusters, through instancing
+    TRIANGLE_SOUP,
+    MANY_LIGHTS // a fixed sphere grid lit by `primitives` point lights
+};
+
+struct GeneratedScene {
+    std::vector<TriangleMesh> meshes;
+    std::vector<GeometrySet> geometry_sets;
+    std::vector<Instance> instances;
+    std::vector<Light> lights;
+    size_t primitives; // spheres and triangles counted per instance, or lights
+};
+
+const Vector3 GENERATED_CENTER = { -1.5f, 0.5f, 6.f };
+const float GENERATED_HALF_SIZE = 1.5f;
+
+// splitmix64. The standard distributions are not specified bit for bit, so
+// this keeps a seed producing the same scene on every compiler.
+struct SceneRng {
+    uint64_t state;
+
+    uint64_t Next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    float Uniform() { return (Next() >> 40) * (1.f / 16777216.f); }
+    float Range(float lo, float hi) { return lo + (hi - lo) * Uniform(); }
+};
+
+// A handful of materials so large scenes still share table entries.
+Sphere GeneratedSphere(SceneRng& rng, const Vector3& center, float radius) {
+    static const Color PALETTE[] = {
+        {0, 0, 255}, {0, 255, 0}, {255, 0, 0}, {0, 255, 255},
+        {255, 0, 255}, {255, 255, 0}, {0, 128, 255}, {200, 200, 200}
+    };
+    static const int SPECULARS[] = { 10, 100, 500 };
+    static const float REFLECTIVES[] = { 0.f, 0.2f, 0.5f };
+
+    return { center, radius, PALETTE[rng.Next() % 8], SPECULARS[rng.Next() % 3], REFLECTIVES[rng.Next() % 3] };
+}
+
+void GenerateSphereGrid(SceneRng& rng, size_t count, std::vector<Sphere>& spheres) {
+    size_t side = max(static_cast<size_t>(1), static_cast<size_t>(std::ceil(std::cbrt(static_cast<double>(count)))));
+    float spacing = 2 * GENERATED_HALF_SIZE / side;
+    Vector3 corner = Subtract(GENERATED_CENTER, { GENERATED_HALF_SIZE, GENERATED_HALF_SIZE, GENERATED_HALF_SIZE });
+
+    for (size_t i = 0; i < count; i++) {
+        Vector3 cell = {
+            (i % side + 0.5f) * spacing,
+            (i / side % side + 0.5f) * spacing,
+            (i / (side * side) + 0.5f) * spacing
+        };
+        spheres.push_back(GeneratedSphere(rng, Add(corner, cell), 0.35f * spacing));
+    }
+}
+
+// Places `count` instances of geometry 0 (a cluster of unit size) by
+// splitting the cube into octants until each holds one.
+void PlaceClusters(SceneRng& rng, const Vector3& center, float half_size, size_t count,
+    std::vector<Instance>& instances) {
+    if (count == 1) {
+        float angle = rng.Range(0.f, 6.2831853f);
+        float scale = half_size / 0.75f;
+        float c = scale * std::cos(angle), s = scale * std::sin(angle);
+        instances.push_back({ 0, { c, 0, s, 0, scale, 0, -s, 0, c }, center });
+        return;
+    }
+
+    size_t child_count = count / 8;
+    size_t remainder = count % 8;
+    for (int octant = 0; octant < 8; octant++) {
+        size_t n = child_count + (static_cast<size_t>(octant) < remainder ? 1 : 0);
+        if (n == 0) {
+            continue;
+        }
+        Vector3 offset = {
+            octant & 1 ? half_size / 2 : -half_size / 2,
+            octant & 2 ? half_size / 2 : -half_size / 2,
+            octant & 4 ? half_size / 2 : -half_size / 2
+        };
+        PlaceClusters(rng, Add(center, offset), half_size / 2, n, instances);
+    }
+}
+
+GeneratedScene GenerateScene(SceneKind kind, size_t primitives, uint64_t seed) {
+    TRACE_ZONE("GenerateScene");
+
+    SceneRng rng = { seed };
+    GeneratedScene scene;
+    scene.primitives = primitives;
+    scene.lights = LIGHTS;
+
+    const Matrix3 identity = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+    float typical_size = 2 * GENERATED_HALF_SIZE / static_cast<float>(std::cbrt(static_cast<double>(max(primitives, static_cast<size_t>(1)))));
+
+    switch (kind) {
+    case SceneKind::SPHERE_GRID:
+    case SceneKind::MANY_LIGHTS: {
+        GeometrySet set;
+        GenerateSphereGrid(rng, kind == SceneKind::MANY_LIGHTS ? 1000 : primitives, set.spheres);
+        scene.geometry_sets.push_back(std::move(set));
+        scene.instances.push_back({ 0, identity, { 0.f, 0.f, 0.f } });
+
+        if (kind == SceneKind::MANY_LIGHTS) {
+            scene.lights = { { LightType::AMBIENT, 0.2f, {INFINITY, INFINITY, INFINITY} } };
+            for (size_t i = 0; i < primitives; i++) {
+                Vector3 position = {
+                    GENERATED_CENTER.x + rng.Range(-2.f, 2.f) * GENERATED_HALF_SIZE,
+                    GENERATED_CENTER.y + rng.Range(1.2f, 3.f) * GENERATED_HALF_SIZE,
+                    GENERATED_CENTER.z + rng.Range(-2.f, 2.f) * GENERATED_HALF_SIZE
+                };
+                scene.lights.push_back({ LightType::POINT, 0.8f / primitives, position });
+            }
+        }
+        break;
+    }
+
+    case SceneKind::RANDOM_CLOUD: {
+        GeometrySet set;
+        for (size_t i = 0; i < primitives; i++) {
+            Vector3 center = {
+                GENERATED_CENTER.x + rng.Range(-1.f, 1.f) * GENERATED_HALF_SIZE,
+                GENERATED_CENTER.y + rng.Range(-1.f, 1.f) * GENERATED_HALF_SIZE,
+                GENERATED_CENTER.z + rng.Range(-1.f, 1.f) * GENERATED_HALF_SIZE
+            };
+            set.spheres.push_back(GeneratedSphere(rng, center, rng.Range(0.1f, 0.3f) * typical_size));
+        }
+        scene.geometry_sets.push_back(std::move(set));
+        scene.instances.push_back({ 0, identity, { 0.f, 0.f, 0.f } });
+        break;
+    }
+
+    case SceneKind::NESTED_CLUSTERS: {
+        // Eight mirror-like spheres on the corners of a cube of half size 0.75.
+        GeometrySet cluster;
+        for (int corner = 0; corner < 8; corner++) {
+            Vector3 center = { corner & 1 ? 0.5f : -0.5f, corner & 2 ? 0.5f : -0.5f, corner & 4 ? 0.5f : -0.5f };
+            Sphere sphere = GeneratedSphere(rng, center, 0.25f);
+            sphere.reflective = 0.6f;
+            cluster.spheres.push_back(sphere);
+        }
+        scene.geometry_sets.push_back(std::move(cluster));
+        PlaceClusters(rng, GENERATED_CENTER, GENERATED_HALF_SIZE, max(static_cast<size_t>(1), primitives / 8), scene.instances);
+        scene.primitives = 8 * scene.instances.size();
+        break;
+    }
+
+    case SceneKind::TRIANGLE_SOUP: {
+        // One mesh per material, triangles dealt round-robin.
+        for (int m = 0; m < 4; m++) {
+            Sphere look = GeneratedSphere(rng, GENERATED_CENTER, 0.f);
+            scene.meshes.push_back({ {}, {}, look.color, look.specular, look.reflective });
+        }
+        for (size_t i = 0; i < primitives; i++) {
+            TriangleMesh& mesh = scene.meshes[i % 4];
+            Vector3 center = {
+                GENERATED_CENTER.x + rng.Range(-1.f, 1.f) * GENERATED_HALF_SIZE,
+                GENERATED_CENTER.y + rng.Range(-1.f, 1.f) * GENERATED_HALF_SIZE,
+                GENERATED_CENTER.z + rng.Range(-1.f, 1.f) * GENERATED_HALF_SIZE
+            };
+            for (int k = 0; k < 3; k++) {
+                Vector3 offset = { rng.Range(-1.f, 1.f), rng.Range(-1.f, 1.f), rng.Range(-1.f, 1.f) };
+                mesh.indices.push_back(static_cast<int>(mesh.vertices.size()));
+                mesh.vertices.push_back(Add(center, Multiply(0.5f * typical_size, offset)));
+            }
+        }
+        break;
+    }
+    }
+
+    return scene;
+}
+
+bool ParseSceneKind(const std::string& name, SceneKind& kind) {
+    static const std::pair<const char*, SceneKind> NAMES[] = {
+        { "grid", SceneKind::SPHERE_GRID }, { "cloud", SceneKind::RANDOM_CLOUD },
+        { "clusters", SceneKind::NESTED_CLUSTERS }, { "soup", SceneKind::TRIANGLE_SOUP },
+        { "lights", SceneKind::MANY_LIGHTS }
+    };
+    for (const auto& entry : NAMES) {
+        if (name == entry.first) {
+            kind = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+Scene BuildGeneratedScene(const GeneratedScene& generated, const std::vector<TriangleMesh>& extra_meshes,
+    const std::vector<Texture>& textures = TEXTURES) {
+    std::vector<TriangleMesh> meshes = generated.meshes;
+    meshes.insert(meshes.end(), extra_meshes.begin(), extra_meshes.end());
+    return BuildScene({}, PLANES, {}, meshes, generated.geometry_sets, generated.instances, generated.lights, textures);
+}
+
+template <typename T>
+size_t VectorBytes(const std::vector<T>& v) {
+    return v.capacity() * sizeof(T);
+}
+
+size_t BvhBytes(const Bvh& bvh) {
+    return VectorBytes(bvh.nodes) + VectorBytes(bvh.prim_indices);
+}
+
+size_t MeshBytes(const MeshAccel& mesh) {
+    return BvhBytes(mesh.bvh) + VectorBytes(mesh.packets) + VectorBytes(mesh.vertices) + VectorBytes(mesh.indices);
+}
+
+// Heap bytes held by the acceleration structures and scene arrays.
+size_t SceneBytes(const Scene& scene) {
+    size_t bytes = VectorBytes(scene.materials) + VectorBytes(scene.spheres) + VectorBytes(scene.lights);
+    bytes += 4 * VectorBytes(scene.planes.offset) + VectorBytes(scene.planes.material);
+    bytes += 6 * VectorBytes(scene.boxes.min_x) + VectorBytes(scene.boxes.material);
+    for (const MeshAccel& mesh : scene.meshes) {
+        bytes += MeshBytes(mesh);
+    }
+    for (const GeometryAccel& geometry : scene.geometries) {
+        bytes += VectorBytes(geometry.spheres) + BvhBytes(geometry.sphere_bvh);
+        for (const MeshAccel& mesh : geometry.meshes) {
+            bytes += MeshBytes(mesh);
+        }
+    }
+    bytes += VectorBytes(scene.instances) + VectorBytes(scene.instance_inverse) +
+        BvhBytes(scene.instance_bvh) + VectorBytes(scene.instance_built_area);
+    bytes += VectorBytes(scene.light_tree.lights) + BvhBytes(scene.light_tree.bvh) +
+        VectorBytes(scene.light_tree.intensity) + VectorBytes(scene.light_tree.representative);
+    return bytes;
+}
+
+// Generates, builds and renders scenes of 10, 100, ... up to max_primitives
+// and writes one CSV row per size. Render time is one frame with the
+// default camera, including the AA pass.
+bool RunScalingReport(SceneKind kind, size_t max_primitives, uint64_t seed,
+    std::vector<std::thread>& threads, const std::string& path) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    out << "primitives,generate_ms,build_ms,scene_mb,render_ms\n";
+
+    for (size_t count = 10; count <= max_primitives; count *= 10) {
+        auto t0 = std::chrono::high_resolution_clock::now();
+        GeneratedScene generated = GenerateScene(kind, count, seed);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        activeScene = BuildGeneratedScene(generated, {});
+        auto t2 = std::chrono::high_resolution_clock::now();
+        RenderFrame(threads, activeScene, CAMERA_ROTATION, CAMERA_POSITION, renderGeneration.load());
+        auto t3 = std::chrono::high_resolution_clock::now();
+
+        auto ms = [](auto from, auto to) {
+            return std::chrono::duration<double, std::milli>(to - from).count();
+        };
+        out << generated.primitives << ',' << ms(t0, t1) << ',' << ms(t1, t2) << ','
+            << SceneBytes(activeScene) / 1048576.0 << ',' << ms(t2, t3) << std::endl;
+    }
+    return true;
+}
+
+// =============================================================================
+//                               Golden images
+// =============================================================================
+// Headless regression check for kernel changes: renders a fixed set of
+// reference scenes, compares each with <dir>/<name>.ppm by mean SSIM over
+// 8x8 windows of luma and writes <dir>/golden_report.csv with the render
+// time next to the result.
+
+const double GOLDEN_MIN_SSIM = 0.99;
+const int SSIM_WINDOW = 8;
+
+struct GoldenScene {
+    const char* name;
+    bool generated; // false for the demo scene
+    SceneKind kind;
+    size_t primitives;
+};
+
+const GoldenScene GOLDEN_SCENES[] = {
+    { "demo", false, SceneKind::SPHERE_GRID, 0 },
+    { "grid", true, SceneKind::SPHERE_GRID, 1000 },
+    { "clusters", true, SceneKind::NESTED_CLUSTERS, 512 },
+    { "soup", true, SceneKind::TRIANGLE_SOUP, 2000 },
+    { "lights", true, SceneKind::MANY_LIGHTS, 64 }
+};
+
+bool WritePpm(const std::string& path, const std::vector<DWORD>& pixels, int width, int height) {
+    std::ofstream out(path, std::ios::binary);
+    out << "P6\n" << width << ' ' << height << "\n255\n";
+    for (DWORD pixel : pixels) {
+        char rgb[3] = { static_cast<char>(GetBValue(pixel)), static_cast<char>(GetGValue(pixel)),
+            static_cast<char>(GetRValue(pixel)) }; // canvas pixels are stored BGR
+        out.write(rgb, 3);
+    }
+    return static_cast<bool>(out);
+}
+
+float PixelLuma(DWORD pixel) {
+    return 0.299f * GetBValue(pixel) + 0.587f * GetGValue(pixel) + 0.114f * GetRValue(pixel);
+}
+
+// Mean structural similarity of two images over windows stepped by half
+// their size; 1 for identical images.
+double MeanSsim(const std::vector<DWORD>& a, const std::vector<DWORD>& b, int width, int height) {
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    const int n = SSIM_WINDOW * SSIM_WINDOW;
+    double total = 0;
+    int windows = 0;
+
+    for (int y = 0; y + SSIM_WINDOW <= height; y += SSIM_WINDOW / 2) {
+        for (int x = 0; x + SSIM_WINDOW <= width; x += SSIM_WINDOW / 2) {
+            double sum_a = 0, sum_b = 0, sum_aa = 0, sum_bb = 0, sum_ab = 0;
+            for (int wy = 0; wy < SSIM_WINDOW; wy++) {
+                for (int wx = 0; wx < SSIM_WINDOW; wx++) {
+                    size_t offset = static_cast<size_t>(y + wy) * width + x + wx;
+                    double la = PixelLuma(a[offset]), lb = PixelLuma(b[offset]);
+                    sum_a += la;
+                    sum_b += lb;
+                    sum_aa += la * la;
+                    sum_bb += lb * lb;
+                    sum_ab += la * lb;
+                }
+            }
+
+            double mean_a = sum_a / n, mean_b = sum_b / n;
+            double var_a = sum_aa / n - mean_a * mean_a;
+            double var_b = sum_bb / n - mean_b * mean_b;
+            double covariance = sum_ab / n - mean_a * mean_b;
+            total += (2 * mean_a * mean_b + c1) * (2 * covariance + c2) /
+                ((mean_a * mean_a + mean_b * mean_b + c1) * (var_a + var_b + c2));
+            windows++;
+        }
+    }
+    return windows > 0 ? total / windows : 1.0;
+}
+
+// Renders every golden scene and either stores it (update) or checks it.
+// Returns the number of scenes that failed.
+int RunGoldenTests(const std::string& dir, bool update, std::vector<std::thread>& threads) {
+    std::ofstream report(dir + "/golden_report.csv");
+    report << "scene,render_ms,ssim,max_channel_diff,result\n";
+    int failures = 0;
+
+    for (const GoldenScene& golden : GOLDEN_SCENES) {
+        activeScene = golden.generated
+            ? BuildGeneratedScene(GenerateScene(golden.kind, golden.primitives, 1), {})
+            : BuildScene(SPHERES, PLANES, BOXES, MESHES, GEOMETRY_SETS, INSTANCES, LIGHTS, TEXTURES);
+        std::fill(canvasBuffer.begin(), canvasBuffer.end(),
+            RGB(BACKGROUND_COLOR.b, BACKGROUND_COLOR.g, BACKGROUND_COLOR.r));
+
+        auto start = std::chrono::high_resolution_clock::now();
+        RenderFrame(threads, activeScene, CAMERA_ROTATION, CAMERA_POSITION, renderGeneration.load());
+        double render_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::high_resolution_clock::now() - start).count();
+
+        std::string path = dir + "/" + golden.name + ".ppm";
+        if (update) {
+            bool written = WritePpm(path, canvasBuffer, CANVAS_WIDTH, CANVAS_HEIGHT);
+            failures += written ? 0 : 1;
+            report << golden.name << ',' << render_ms << ",,," << (written ? "updated" : "write failed") << '\n';
+            continue;
+        }
+
+        std::vector<DWORD> reference;
+        int width, height;
+        if (!ReadPpm(path, reference, width, height) || width != CANVAS_WIDTH || height != CANVAS_HEIGHT) {
+            failures++;
+            report << golden.name << ',' << render_ms << ",,,missing\n";
+            continue;
+        }
+
+        int max_diff = 0;
+        for (size_t i = 0; i < reference.size(); i++) {
+            for (int shift = 0; shift < 24; shift += 8) {
+                int diff = std::abs(static_cast<int>((reference[i] >> shift) & 0xFF) -
+                    static_cast<int>((canvasBuffer[i] >> shift) & 0xFF));
+                max_diff = max(max_diff, diff);
+            }
+        }
+        double ssim = MeanSsim(reference, canvasBuffer, CANVAS_WIDTH, CANVAS_HEIGHT);
+        bool passed = ssim >= GOLDEN_MIN_SSIM;
+        failures += passed ? 0 : 1;
+        report << golden.name << ',' << render_ms << ',' << ssim << ',' << max_diff << ','
+            << (passed ? "pass" : "FAIL") << '\n';
+    }
+
+    return failures;
+}
+
+// =============================================================================
+//                               Render server
+// =============================================================================
+// "--serve <socket>" keeps the process alive as a render daemon on a Unix
+// domain socket. Each request is one line:
+//   <id> <priority> <scene> <x> <y> <z> <yaw> <pitch> <width> <height> <preview|final>
+// where scene is "demo", "mesh:<file>" or "<kind>:<primitives>[:<seed>]".
+// Jobs run one at a time, highest priority first, and each reply is a line
+//   done <id> <width> <height> <build_ms> <render_ms>
+// followed by width * height RGB bytes, or "error <id> <reason>". The
+// SERVER_SCENE_CACHE most recently used scenes stay built, so build_ms is 0
+// for jobs that reuse one. Generated scenes are limited to
+// SERVER_MAX_PRIMITIVES. A "shutdown" line finishes the queued jobs and exits.
+
+const double SERVER_MAX_PRIMITIVES = 1e7;
+const size_t SERVER_SCENE_CACHE = 4;
+
+bool SendAll(SOCKET socket, const std::string& data) {
+    for (size_t sent = 0; sent < data.size();) {
+        int n = send(socket, data.data() + sent, static_cast<int>(data.size() - sent), 0);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+bool RecvExact(SOCKET socket, char* data, size_t size) {
+    for (size_t received = 0; received < size;) {
+        int n = recv(socket, data + received, static_cast<int>(size - received), 0);
+        if (n <= 0) {
+            return false;
+        }
+        received += n;
+    }
+    return true;
+}
+
+// Reads one '\n'-terminated line a byte at a time, so binary data that
+// follows it stays in the socket.
+bool RecvLine(SOCKET socket, std::string& line) {
+    line.clear();
+    for (char c; RecvExact(socket, &c, 1);) {
+        if (c == '\n') {
+            return true;
+        }
+        line += c;
+    }
+    return false;
+}
+
+SOCKET ListenUnixSocket(const std::string& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return INVALID_SOCKET;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    std::error_code error;
+    std::filesystem::remove(path, error); // left behind by an earlier run
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+        listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+        closesocket(listener);
+        return INVALID_SOCKET;
+    }
+    return listener;
+}
+
+SOCKET ConnectUnixSocket(const std::string& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return INVALID_SOCKET;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    SOCKET connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection != INVALID_SOCKET &&
+        connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR) {
+        closesocket(connection);
+        return INVALID_SOCKET;
+    }
+    return connection;
+}
+
+struct ServerConnection {
+    SOCKET socket;
+    std::mutex write_mutex; // replies come from the reader and render threads
+
+    explicit ServerConnection(SOCKET s) : socket(s) {}
+    ~ServerConnection() { closesocket(socket); }
+
+    bool Send(const std::string& data) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        return SendAll(socket, data);
+    }
+};
+
+struct RenderJob {
+    int priority;
+    uint64_t sequence; // keeps jobs of equal priority in arrival order
+    std::string id;
+    std::string scene;
+    Vector3 position;
+    float yaw, pitch; // degrees
+    int width, height;
+    bool antialias;
+    std::shared_ptr<ServerConnection> connection;
+};
+
+struct RenderJobOrder {
+    bool operator()(const RenderJob& a, const RenderJob& b) const {
+        return a.priority != b.priority ? a.priority < b.priority : a.sequence > b.sequence;
+    }
+};
+
+struct RenderJobQueue {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::priority_queue<RenderJob, std::vector<RenderJob>, RenderJobOrder> jobs;
+    uint64_t next_sequence = 0;
+    bool stopping = false;
+};
+
+bool ParseRenderJob(const std::string& line, RenderJob& job) {
+    std::istringstream in(line);
+    std::string quality;
+    if (!(in >> job.id >> job.priority >> job.scene >> job.position.x >> job.position.y >> job.position.z
+        >> job.yaw >> job.pitch >> job.width >> job.height >> quality)) {
+        return false;
+    }
+    job.antialias = quality == "final";
+    return (quality == "final" || quality == "preview") && job.width > 0 && job.height > 0 &&
+        job.width <= 4 * CANVAS_WIDTH && job.height <= 4 * CANVAS_HEIGHT;
+}
+
+// Builds the scene a job refers to; see the protocol above. On failure
+// error receives the reason sent back to the client.
+bool BuildSceneReference(const std::string& reference, unsigned num_threads, Scene& scene, std::string& error) {
+    error = "unknown scene";
+    if (reference == "demo") {
+        scene = BuildScene(SPHERES, PLANES, BOXES, MESHES, GEOMETRY_SETS, INSTANCES, LIGHTS, TEXTURES);
+        return true;
+    }
+    if (reference.rfind("mesh:", 0) == 0) {
+        TriangleMesh mesh = { {}, {}, {160, 160, 160}, 200, 0.1f }; // grey, as for --mesh
+        if (!LoadMesh(reference.substr(5), num_threads, mesh)) {
+            return false;
+        }
+        std::vector<TriangleMesh> meshes = MESHES;
+        meshes.push_back(mesh);
+        scene = BuildScene(SPHERES, PLANES, BOXES, meshes, GEOMETRY_SETS, INSTANCES, LIGHTS, TEXTURES);
+        return true;
+    }
+
+    size_t colon = reference.find(':');
+    SceneKind kind;
+    if (colon == std::string::npos || !ParseSceneKind(reference.substr(0, colon), kind)) {
+        return false;
+    }
+    char* end = nullptr;
+    double primitives = std::strtod(reference.c_str() + colon + 1, &end);
+    uint64_t seed = *end == ':' ? std::strtoull(end + 1, nullptr, 10) : 1;
+    if (!std::isfinite(primitives) || primitives < 1) {
+        return false;
+    }
+    if (primitives > SERVER_MAX_PRIMITIVES) {
+        error = "scene too large";
+        return false;
+    }
+    scene = BuildGeneratedScene(GenerateScene(kind, static_cast<size_t>(primitives), seed), {});
+    return true;
+}
+
+// Yaw about the y axis, then pitch about the x axis; yaw -45 and pitch 0
+// give CAMERA_ROTATION.
+Matrix3 CameraRotation(float yaw_degrees, float pitch_degrees) {
+    const float to_radians = 3.14159265f / 180.f;
+    float cy = std::cos(yaw_degrees * to_radians), sy = std::sin(yaw_degrees * to_radians);
+    float cp = std::cos(pitch_degrees * to_radians), sp = std::sin(pitch_degrees * to_radians);
+    return { {
+        cy, sy * sp, sy * cp,
+        0.f, cp, -sp,
+        -sy, cy * sp, cy * cp
+    } };
+}
+
+// Box-filters the canvas down (or repeats pixels up) to width x height RGB.
+std::string ResampleCanvas(int width, int height) {
+    std::string rgb(3 * static_cast<size_t>(width) * height, '\0');
+    char* out = &rgb[0];
+
+    for (int y = 0; y < height; y++) {
+        int y0 = y * CANVAS_HEIGHT / height;
+        int y1 = max(y0 + 1, (y + 1) * CANVAS_HEIGHT / height);
+        for (int x = 0; x < width; x++) {
+            int x0 = x * CANVAS_WIDTH / width;
+            int x1 = max(x0 + 1, (x + 1) * CANVAS_WIDTH / width);
+
+            unsigned r = 0, g = 0, b = 0;
+            for (int sy = y0; sy < y1; sy++) {
+                for (int sx = x0; sx < x1; sx++) {
+                    DWORD pixel = canvasBuffer[sx + CANVAS_WIDTH * sy];
+                    r += GetBValue(pixel); // canvas pixels are stored BGR
+                    g += GetGValue(pixel);
+                    b += GetRValue(pixel);
+                }
+            }
+            unsigned n = (x1 - x0) * (y1 - y0);
+            *out++ = static_cast<char>(r / n);
+            *out++ = static_cast<char>(g / n);
+            *out++ = static_cast<char>(b / n);
+        }
+    }
+    return rgb;
+}
+
+// Reads request lines from one client and queues them until it disconnects.
+void ServeConnection(std::shared_ptr<ServerConnection> connection, std::shared_ptr<RenderJobQueue> queue) {
+    std::string pending;
+    char buffer[4096];
+
+    for (int n; (n = recv(connection->socket, buffer, sizeof(buffer), 0)) > 0;) {
+        pending.append(buffer, n);
+        for (size_t eol; (eol = pending.find('\n')) != std::string::npos; pending.erase(0, eol + 1)) {
+            std::string line = pending.substr(0, eol);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.empty()) {
+                continue;
+            }
+
+            RenderJob job;
+            const char* rejected = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(queue->mutex);
+                if (line == "shutdown") {
+                    queue->stopping = true;
+                    queue->ready.notify_all();
+                    continue;
+                }
+                if (queue->stopping || !ParseRenderJob(line, job)) {
+                    rejected = queue->stopping ? " shutting down\n" : " malformed request\n";
+                }
+                else {
+                    job.sequence = queue->next_sequence++;
+                    job.connection = connection;
+                    queue->jobs.push(std::move(job));
+                    queue->ready.notify_one();
+                }
+            }
+            if (rejected != nullptr) {
+                connection->Send("error " + line.substr(0, line.find(' ')) + rejected);
+            }
+        }
     }
-    else {
-        x_left = &x01;
-        x_right = &x02;
+}
+
+// Runs the daemon until a client asks it to shut down. Returns the exit code.
+int RunRenderServer(const std::string& socket_path, std::vector<std::thread>& threads) {
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        return 1;
     }
 
-    // Draw horizontal segments.
-    for (int y = p0.y; y <= p2.y; y++) {
-        for (int x = static_cast<int>((*x_left)[y - p0.y]); x <= static_cast<int>((*x_right)[y - p0.y]); x++) {
-            PutPixel(x, y, color);
+    SOCKET listener = ListenUnixSocket(socket_path);
+    if (listener == INVALID_SOCKET) {
+        WSACleanup();
+        return 1;
+    }
+
+    // Clients are accepted on their own threads; this thread only renders,
+    // so the canvas and the scene cache need no locking. The readers are
+    // kept, with their connections, so shutdown can unblock and join them.
+    struct ClientReader {
+        std::shared_ptr<ServerConnection> connection;
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> finished;
+    };
+    auto queue = std::make_shared<RenderJobQueue>();
+    std::vector<ClientReader> readers; // owned by accept_thread until it is joined
+    std::thread accept_thread([listener, queue, &readers] {
+        for (SOCKET client; (client = accept(listener, nullptr, nullptr)) != INVALID_SOCKET;) {
+            // Readers of closed connections are reaped as new ones arrive.
+            for (auto it = readers.begin(); it != readers.end();) {
+                if (it->finished->load()) {
+                    it->thread.join();
+                    it = readers.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+            auto connection = std::make_shared<ServerConnection>(client);
+            auto finished = std::make_shared<std::atomic<bool>>(false);
+            readers.push_back({ connection, std::thread([connection, queue, finished] {
+                ServeConnection(connection, queue);
+                finished->store(true);
+            }), finished });
+        }
+    });
+
+    std::list<std::pair<std::string, Scene>> scenes; // most recently used first
+    while (true) {
+        RenderJob job;
+        {
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            queue->ready.wait(lock, [&] { return queue->stopping || !queue->jobs.empty(); });
+            if (queue->jobs.empty()) {
+                break;
+            }
+            job = queue->jobs.top();
+            queue->jobs.pop();
+        }
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+        auto cached = std::find_if(scenes.begin(), scenes.end(),
+            [&](const std::pair<std::string, Scene>& entry) { return entry.first == job.scene; });
+        if (cached != scenes.end()) {
+            scenes.splice(scenes.begin(), scenes, cached);
+        }
+        else {
+            Scene scene;
+            std::string error;
+            if (!BuildSceneReference(job.scene, static_cast<unsigned>(threads.size()), scene, error)) {
+                job.connection->Send("error " + job.id + " " + error + "\n");
+                continue;
+            }
+            if (scenes.size() >= SERVER_SCENE_CACHE) {
+                scenes.pop_back();
+            }
+            scenes.emplace_front(job.scene, std::move(scene));
+        }
+        cached = scenes.begin();
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+        std::fill(canvasBuffer.begin(), canvasBuffer.end(),
+            RGB(BACKGROUND_COLOR.b, BACKGROUND_COLOR.g, BACKGROUND_COLOR.r));
+        RenderFrame(threads, cached->second, CameraRotation(job.yaw, job.pitch), job.position,
+            renderGeneration.load(), job.antialias);
+        auto t2 = std::chrono::high_resolution_clock::now();
+
+        auto ms = [](auto a, auto b) { return std::chrono::duration<double, std::milli>(b - a).count(); };
+        job.connection->Send("done " + job.id + " " + std::to_string(job.width) + " " +
+            std::to_string(job.height) + " " + std::to_string(ms(t0, t1)) + " " +
+            std::to_string(ms(t1, t2)) + "\n" + ResampleCanvas(job.width, job.height));
+    }
+
+    // Closing the listener ends accept_thread; shutting the client sockets
+    // down wakes readers blocked in recv. Only then may Winsock go away.
+    closesocket(listener);
+    accept_thread.join();
+    for (ClientReader& reader : readers) {
+        shutdown(reader.connection->socket, SD_BOTH);
+        reader.thread.join();
+    }
+    readers.clear();
+
+    std::error_code error;
+    std::filesystem::remove(socket_path, error);
+    WSACleanup();
+    return 0;
+}
+
+// =============================================================================
+//                           Distributed rendering
+// =============================================================================
+// "--distribute <workers>" starts that many copies of this program with
+// "--worker <socket>" and the same scene arguments, then farms the frame out
+// to them in bands of DISTRIBUTED_TILE_ROWS rows. Workers pull the next band
+// as soon as they return one, so faster nodes take more of the frame. A band
+// held by a worker that disconnects goes back on the queue, and if every
+// worker is gone the coordinator renders what is left itself.
+//   coordinator -> worker: "tile <start_y> <end_y>" or "done"
+//   worker -> coordinator: "pixels <start_y> <end_y>" + the band's canvas rows
+
+const int DISTRIBUTED_TILE_ROWS = 20;
+const auto DISTRIBUTED_CONNECT_TIMEOUT = 10s; // for workers that never call in
+const DWORD DISTRIBUTED_EXIT_WAIT_MS = 5000;
+
+// Canvas rows written by RenderRows(start_y, end_y).
+std::pair<int, int> BandRows(int start_y, int end_y) {
+    return { max(0, CANVAS_HEIGHT / 2 - end_y + 1), min(CANVAS_HEIGHT, CANVAS_HEIGHT / 2 - start_y + 1) };
+}
+
+struct TileFarm {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<int> pending; // start_y of bands not handed out yet
+    int remaining = 0; // bands not yet assembled
+    int live_workers = 0;
+    int connected_workers = 0;
+};
+
+// Feeds bands to one worker until the frame is done or the worker fails.
+void DriveWorker(SOCKET worker, TileFarm& farm) {
+    while (true) {
+        int start_y;
+        {
+            std::unique_lock<std::mutex> lock(farm.mutex);
+            farm.changed.wait(lock, [&] { return farm.remaining == 0 || !farm.pending.empty(); });
+            if (farm.remaining == 0) {
+                break;
+            }
+            start_y = farm.pending.back();
+            farm.pending.pop_back();
+        }
+
+        int end_y = min(start_y + DISTRIBUTED_TILE_ROWS, CANVAS_HEIGHT / 2);
+        std::pair<int, int> rows = BandRows(start_y, end_y);
+        std::string header = "pixels " + std::to_string(start_y) + " " + std::to_string(end_y);
+        std::string reply;
+        bool received = SendAll(worker, "tile " + std::to_string(start_y) + " " + std::to_string(end_y) + "\n") &&
+            RecvLine(worker, reply) && reply == header &&
+            RecvExact(worker, reinterpret_cast<char*>(&canvasBuffer[CANVAS_WIDTH * rows.first]),
+                sizeof(DWORD) * CANVAS_WIDTH * (rows.second - rows.first));
+
+        std::lock_guard<std::mutex> lock(farm.mutex);
+        if (!received) {
+            farm.pending.push_back(start_y); // retried by another worker
+            break;
+        }
+        farm.remaining--;
+        farm.changed.notify_all();
+    }
+
+    SendAll(worker, "done\n");
+    closesocket(worker);
+    std::lock_guard<std::mutex> lock(farm.mutex);
+    farm.live_workers--;
+    farm.changed.notify_all();
+}
+
+// Renders the frame on worker processes. forwarded_args are appended to
+// each worker's command line so it builds the same scene.
+bool RenderDistributed(int num_workers, const std::string& forwarded_args, std::vector<std::thread>& threads) {
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        return false;
+    }
+    std::string socket_path = (std::filesystem::temp_directory_path() /
+        ("raytracer-" + std::to_string(GetCurrentProcessId()) + ".sock")).string();
+    SOCKET listener = ListenUnixSocket(socket_path);
+    if (listener == INVALID_SOCKET) {
+        WSACleanup();
+        return false;
+    }
+
+    TileFarm farm;
+    for (int y = -CANVAS_HEIGHT / 2; y < CANVAS_HEIGHT / 2; y += DISTRIBUTED_TILE_ROWS) {
+        farm.pending.push_back(y);
+    }
+    std::reverse(farm.pending.begin(), farm.pending.end()); // hand out top to bottom
+    farm.remaining = static_cast<int>(farm.pending.size());
+
+    char exe_path[MAX_PATH];
+    GetModuleFileNameA(nullptr, exe_path, MAX_PATH);
+    std::vector<HANDLE> workers;
+    for (int i = 0; i < num_workers; i++) {
+        std::string command = "\"" + std::string(exe_path) + "\" --worker \"" + socket_path + "\"" + forwarded_args;
+        STARTUPINFOA startup = { sizeof(startup) };
+        PROCESS_INFORMATION process = {};
+        if (CreateProcessA(nullptr, &command[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &process)) {
+            CloseHandle(process.hThread);
+            workers.push_back(process.hProcess);
+        }
+    }
+
+    std::vector<std::thread> drivers;
+    std::thread acceptor([&] {
+        for (size_t i = 0; i < workers.size(); i++) {
+            SOCKET worker = accept(listener, nullptr, nullptr);
+            if (worker == INVALID_SOCKET) {
+                break;
+            }
+            std::lock_guard<std::mutex> lock(farm.mutex);
+            farm.live_workers++;
+            farm.connected_workers++;
+            drivers.emplace_back(DriveWorker, worker, std::ref(farm));
+        }
+    });
+
+    auto started = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(farm.mutex);
+    while (farm.remaining > 0) {
+        farm.changed.wait_for(lock, 100ms);
+        bool all_called_in = farm.connected_workers == static_cast<int>(workers.size()) ||
+            std::chrono::steady_clock::now() - started > DISTRIBUTED_CONNECT_TIMEOUT;
+        if (farm.live_workers > 0 || !all_called_in || farm.remaining == 0) {
+            continue;
+        }
+
+        // No worker left to take the rest of the frame.
+        for (int start_y : farm.pending) {
+            RenderRows(threads, activeScene, CAMERA_ROTATION, CAMERA_POSITION, renderGeneration.load(),
+                ADAPTIVE_AA, start_y, min(start_y + DISTRIBUTED_TILE_ROWS, CANVAS_HEIGHT / 2));
+        }
+        farm.remaining -= static_cast<int>(farm.pending.size());
+        farm.pending.clear();
+        farm.changed.notify_all();
+    }
+    lock.unlock();
+
+    closesocket(listener); // releases an acceptor still waiting for a worker
+    acceptor.join();
+    for (std::thread& driver : drivers) {
+        driver.join();
+    }
+    for (HANDLE worker : workers) {
+        if (WaitForSingleObject(worker, DISTRIBUTED_EXIT_WAIT_MS) == WAIT_TIMEOUT) {
+            TerminateProcess(worker, 1);
+        }
+        CloseHandle(worker);
+    }
+    std::error_code error;
+    std::filesystem::remove(socket_path, error);
+    WSACleanup();
+    return true;
+}
+
+// Worker side of RenderDistributed: renders bands of the already built
+// activeScene until the coordinator says it is done.
+int RunTileWorker(const std::string& socket_path, std::vector<std::thread>& threads) {
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        return 1;
+    }
+    SOCKET coordinator = ConnectUnixSocket(socket_path);
+    if (coordinator == INVALID_SOCKET) {
+        WSACleanup();
+        return 1;
+    }
+
+    std::string request;
+    int start_y, end_y;
+    while (RecvLine(coordinator, request) &&
+        std::sscanf(request.c_str(), "tile %d %d", &start_y, &end_y) == 2) {
+        RenderRows(threads, activeScene, CAMERA_ROTATION, CAMERA_POSITION, renderGeneration.load(),
+            ADAPTIVE_AA, start_y, end_y);
+
+        std::pair<int, int> rows = BandRows(start_y, end_y);
+        std::string reply = "pixels " + std::to_string(start_y) + " " + std::to_string(end_y) + "\n";
+        reply.append(reinterpret_cast<const char*>(&canvasBuffer[CANVAS_WIDTH * rows.first]),
+            sizeof(DWORD) * CANVAS_WIDTH * (rows.second - rows.first));
+        if (!SendAll(coordinator, reply)) {
+            break;
+        }
+    }
+
+    closesocket(coordinator);
+    WSACleanup();
+    return 0;
+}
+
+// =============================================================================
+//                             Shared frame ring
+// =============================================================================
+// "--share <name>" publishes every completed frame into a named shared memory
+// mapping, so viewers, encoders and test tools in other processes can read
+// frames without a copy through the window. The mapping holds a
+// SharedFrameHeader, then SHARED_FRAME_SLOTS canvas-sized slots of BGRX
+// pixels (the canvasBuffer layout, row 0 at the top). Frame n, counting from
+// 1, goes to slot n % SHARED_FRAME_SLOTS. A reader loads `sequence`, reads
+// that slot in place, then checks that its slot_sequence still equals n; a
+// mismatch means the renderer has lapped the reader, which then retries
+// with the newer frame.
+
+const int SHARED_FRAME_SLOTS = 3;
+const uint32_t SHARED_FRAME_MAGIC = 0x42465452; // "RTFB"
+const uint32_t SHARED_FRAME_VERSION = 1;
+
+// Readers in other processes use these counters, so they must not fall back
+// to a lock that lives in this process.
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared frame counters need lock-free atomics");
+
+struct SharedFrameHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t width, height;
+    uint32_t slots;
+    uint32_t slot_offset; // bytes from the start of the mapping to slot 0
+    uint64_t slot_bytes;
+    std::atomic<uint64_t> sequence; // last published frame, 0 before the first
+    std::atomic<uint64_t> slot_sequence[SHARED_FRAME_SLOTS]; // 0 while a slot is written
+};
+
+struct SharedFrameRing {
+    HANDLE mapping = nullptr;
+    SharedFrameHeader* header = nullptr;
+    char* slots = nullptr;
+};
+
+// Fails when a mapping of that name already exists: another producer may be
+// publishing into it, and resetting its header would strand its readers.
+bool OpenSharedFrameRing(const std::string& name, SharedFrameRing& ring) {
+    const uint32_t slot_offset = (sizeof(SharedFrameHeader) + 63) & ~63u; // cache-line aligned slots
+    const uint64_t slot_bytes = sizeof(DWORD) * CANVAS_WIDTH * CANVAS_HEIGHT;
+    const uint64_t size = slot_offset + SHARED_FRAME_SLOTS * slot_bytes;
+
+    ring.mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+        static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), name.c_str());
+    if (ring.mapping == nullptr) {
+        return false;
+    }
+    if (GetLastError() == ERROR_ALREADY_EXISTS) {
+        CloseHandle(ring.mapping);
+        ring.mapping = nullptr;
+        return false;
+    }
+    void* view = MapViewOfFile(ring.mapping, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<size_t>(size));
+    if (view == nullptr) {
+        CloseHandle(ring.mapping);
+        ring.mapping = nullptr;
+        return false;
+    }
+
+    ring.header = new (view) SharedFrameHeader{ SHARED_FRAME_MAGIC, SHARED_FRAME_VERSION,
+        CANVAS_WIDTH, CANVAS_HEIGHT, SHARED_FRAME_SLOTS, slot_offset, slot_bytes, { 0 }, {} };
+    ring.slots = static_cast<char*>(view) + slot_offset;
+    return true;
+}
+
+// Copies a frame into the next slot. Costs one canvas-sized memcpy on
+// the calling thread and never waits for readers.
+void PublishSharedFrame(SharedFrameRing& ring, const std::vector<DWORD>& pixels) {
+    if (ring.header == nullptr) {
+        return;
+    }
+    TRACE_ZONE("PublishSharedFrame");
+
+    uint64_t frame = ring.header->sequence.load(std::memory_order_relaxed) + 1;
+    int slot = static_cast<int>(frame % SHARED_FRAME_SLOTS);
+
+    ring.header->slot_sequence[slot].store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(ring.slots + slot * ring.header->slot_bytes, pixels.data(), ring.header->slot_bytes);
+    ring.header->slot_sequence[slot].store(frame, std::memory_order_release);
+    ring.header->sequence.store(frame, std::memory_order_release);
+}
+
+void CloseSharedFrameRing(SharedFrameRing& ring) {
+    if (ring.header != nullptr) {
+        UnmapViewOfFile(ring.header);
+        CloseHandle(ring.mapping);
+        ring = {};
+    }
+}
+
+// =============================================================================
+//                               Y4M output
+// =============================================================================
+// "--y4m <file>" streams every completed frame to a YUV4MPEG2 file or named
+// pipe for an encoder to pick up. The render loop only copies the canvas into
+// a queue; conversion to 4:2:0 YUV and the writes happen on a pipeline
+// thread. Up to Y4M_QUEUE_FRAMES frames can wait before the render loop
+// blocks, so no frame is ever dropped.
+
+const int Y4M_FRAME_RATE = 30;
+const size_t Y4M_QUEUE_FRAMES = 4;
+
+static_assert(CANVAS_WIDTH % 4 == 0 && CANVAS_HEIGHT % 2 == 0, "YUV conversion works on 4x2 pixel groups");
+
+struct Y4mWriter {
+    std::ofstream out;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::vector<DWORD>> frames; // waiting to be written
+    std::vector<std::vector<DWORD>> spare; // recycled frame buffers
+    bool closing = false;
+
+    Y4mWriter() = default;
+    Y4mWriter(const Y4mWriter&) = delete;
+    Y4mWriter& operator=(const Y4mWriter&) = delete;
+    ~Y4mWriter(); // closes the stream, so every early return writes out the queued frames
+};
+
+// Full-range BT.601 (the C420jpeg colorspace) for 4 pixels x 2 rows at a
+// time: four luma samples per row and two chroma samples from the 2x2 averages.
+void ConvertToYuv420(const DWORD* pixels, unsigned char* y_plane, unsigned char* u_plane, unsigned char* v_plane) {
+    const __m128i byte_mask = _mm_set1_epi32(0xFF);
+    auto pack_bytes = [](__m128 values) {
+        __m128i words = _mm_packs_epi32(_mm_cvtps_epi32(values), _mm_setzero_si128());
+        return _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+    };
+
+    for (int row = 0; row < CANVAS_HEIGHT; row += 2) {
+        for (int col = 0; col < CANVAS_WIDTH; col += 4) {
+            __m128 r_sum = _mm_setzero_ps(), g_sum = _mm_setzero_ps(), b_sum = _mm_setzero_ps();
+
+            for (int i = 0; i < 2; i++) {
+                int offset = col + CANVAS_WIDTH * (row + i);
+                __m128i bgrx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + offset));
+                __m128 b = _mm_cvtepi32_ps(_mm_and_si128(bgrx, byte_mask));
+                __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(bgrx, 8), byte_mask));
+                __m128 r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(bgrx, 16), byte_mask));
+
+                __m128 luma = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.299f)),
+                    _mm_mul_ps(g, _mm_set1_ps(0.587f))), _mm_mul_ps(b, _mm_set1_ps(0.114f)));
+                int y4 = pack_bytes(luma);
+                std::memcpy(y_plane + offset, &y4, 4);
+
+                r_sum = _mm_add_ps(r_sum, r);
+                g_sum = _mm_add_ps(g_sum, g);
+                b_sum = _mm_add_ps(b_sum, b);
+            }
+
+            // Lanes 0 and 1 become the averages of columns (0, 1) and (2, 3).
+            auto pair_average = [](__m128 v) {
+                return _mm_mul_ps(_mm_add_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 0, 2, 0)),
+                    _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 1, 3, 1))), _mm_set1_ps(0.25f));
+            };
+            __m128 r = pair_average(r_sum), g = pair_average(g_sum), b = pair_average(b_sum);
+
+            __m128 u = _mm_add_ps(_mm_set1_ps(128.f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(-0.168736f)),
+                _mm_mul_ps(g, _mm_set1_ps(-0.331264f))), _mm_mul_ps(b, _mm_set1_ps(0.5f))));
+            __m128 v = _mm_add_ps(_mm_set1_ps(128.f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.5f)),
+                _mm_mul_ps(g, _mm_set1_ps(-0.418688f))), _mm_mul_ps(b, _mm_set1_ps(-0.081312f))));
+
+            int chroma_offset = col / 2 + CANVAS_WIDTH / 2 * (row / 2);
+            int u2 = pack_bytes(u), v2 = pack_bytes(v);
+            std::memcpy(u_plane + chroma_offset, &u2, 2);
+            std::memcpy(v_plane + chroma_offset, &v2, 2);
+        }
+    }
+}
+
+void RunY4mPipeline(Y4mWriter& writer) {
+    TraceSetThread(TRACE_PIPELINE_SLOT);
+    const size_t luma_size = static_cast<size_t>(CANVAS_WIDTH) * CANVAS_HEIGHT;
+    std::vector<unsigned char> yuv(luma_size + luma_size / 2);
+
+    while (true) {
+        std::vector<DWORD> frame;
+        {
+            std::unique_lock<std::mutex> lock(writer.mutex);
+            writer.changed.wait(lock, [&] { return writer.closing || !writer.frames.empty(); });
+            if (writer.frames.empty()) {
+                break;
+            }
+            frame = std::move(writer.frames.front());
+            writer.frames.pop_front();
         }
+
+        {
+            TRACE_ZONE("Y4mFrame");
+            ConvertToYuv420(frame.data(), yuv.data(), yuv.data() + luma_size, yuv.data() + luma_size + luma_size / 4);
+            writer.out << "FRAME\n";
+            writer.out.write(reinterpret_cast<const char*>(yuv.data()), yuv.size());
+            writer.out.flush(); // a pipe reader should see each frame as soon as it is done
+        }
+
+        std::lock_guard<std::mutex> lock(writer.mutex);
+        writer.spare.push_back(std::move(frame));
+        writer.changed.notify_all();
+    }
+}
+
+bool OpenY4m(const std::string& path, Y4mWriter& writer) {
+    writer.out.open(path, std::ios::binary | std::ios::trunc);
+    writer.out << "YUV4MPEG2 W" << CANVAS_WIDTH << " H" << CANVAS_HEIGHT << " F" << Y4M_FRAME_RATE
+        << ":1 Ip A1:1 C420jpeg\n";
+    if (!writer.out) {
+        return false;
+    }
+    writer.thread = std::thread(RunY4mPipeline, std::ref(writer));
+    return true;
+}
+
+// Queues a copy of a frame, waiting only when the pipeline is
+// Y4M_QUEUE_FRAMES frames behind.
+void SubmitY4mFrame(Y4mWriter& writer, const std::vector<DWORD>& pixels) {
+    if (!writer.thread.joinable()) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    writer.changed.wait(lock, [&] { return writer.frames.size() < Y4M_QUEUE_FRAMES; });
+    std::vector<DWORD> frame;
+    if (!writer.spare.empty()) {
+        frame = std::move(writer.spare.back());
+        writer.spare.pop_back();
     }
+    frame.assign(pixels.begin(), pixels.end());
+    writer.frames.push_back(std::move(frame));
+    writer.changed.notify_all();
 }
 
+// Writes out the queued frames and closes the stream.
+void CloseY4m(Y4mWriter& writer) {
+    if (!writer.thread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(writer.mutex);
+        writer.closing = true;
+        writer.changed.notify_all();
+    }
+    writer.thread.join();
+    writer.out.close();
+}
 
-//void RenderSection(int start_y, int end_y, const std::vector<Sphere>& spheres,
-//    const std::vector<Light>& lights, const Matrix3& camera_rotation,
-//    const Vector3& camera_position) {
-//
-//    for (int y = start_y; y < end_y; ++y) {
-//        for (int x = -CANVAS_WIDTH / 2; x < CANVAS_WIDTH / 2; ++x) {
-//            Vector3 direction = CanvasToViewport(x, y);
-//            direction = MultiplyMV(camera_rotation, direction);
-//
-//            Color color = TraceRay(camera_position, direction, 1, INFINITY,
-//                spheres, lights, RECURSION_DEPTH, nullptr/*, &cache*/);
-//
-//            PutPixel(x, y, Clamp(color));
-//        }
-//    }
-//}
+Y4mWriter::~Y4mWriter() {
+    CloseY4m(*this);
+}
 
 LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam) {
     HDC hdc;
@@ -330,6 +5847,15 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
         EndPaint(hwnd, &ps);
         break;
 
+    case WM_KEYDOWN:
+        switch (wParam) {
+        case VK_LEFT: cameraNudge.x -= CAMERA_KEY_STEP; break;
+        case VK_RIGHT: cameraNudge.x += CAMERA_KEY_STEP; break;
+        case VK_UP: cameraNudge.z += CAMERA_KEY_STEP; break;
+        case VK_DOWN: cameraNudge.z -= CAMERA_KEY_STEP; break;
+        }
+        break;
+
     case WM_DESTROY:
         PostQuitMessage(0);
         break;
@@ -341,15 +5867,215 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
     return 0;
 }
 
+// Bobs every instance around its authored position.
+void AnimateInstances(Scene& scene, int frame) {
+    for (size_t i = 0; i < scene.instances.size() && i < INSTANCES.size(); i++) {
+        scene.instances[i].translation.y = INSTANCES[i].translation.y + 0.3f * std::sin(0.1f * frame + i);
+    }
+}
+
+// Splits the command line at whitespace; double quotes group a path with spaces.
+std::vector<std::string> SplitCommandLine(const char* command_line) {
+    std::vector<std::string> args;
+    std::string current;
+    bool quoted = false, pending = false;
+
+    for (const char* c = command_line; c != nullptr && *c != '\0'; c++) {
+        if (*c == '"') {
+            quoted = !quoted;
+            pending = true;
+        }
+        else if (!quoted && (*c == ' ' || *c == '\t')) {
+            if (pending) args.push_back(current);
+            current.clear();
+            pending = false;
+        }
+        else {
+            current += *c;
+            pending = true;
+        }
+    }
+    if (pending) args.push_back(current);
+    return args;
+}
+
 int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     _In_ LPSTR lpCmdLine, _In_ int nCmdShow) {
+    TraceSetThread(0);
+
     // Initialize canvas buffer
     canvasBuffer.resize(CANVAS_WIDTH * CANVAS_HEIGHT);
+    objectIdBuffer.resize(CANVAS_WIDTH * CANVAS_HEIGHT, -1);
 
     // Determine the number of threads to use
     unsigned int num_threads = 16;// std::thread::hardware_concurrency();
     std::vector<std::thread> threads(num_threads);
-    int section_width = CANVAS_HEIGHT / num_threads;
+
+    // "--mesh <file.obj|file.ply>" adds a mesh to the scene (repeatable);
+    // "--wireframe" rasterizes the loaded meshes instead of tracing.
+    // "--scene <kind> <primitives> [seed]" replaces the demo objects with a
+    // generated scene; "--scale <kind> <max primitives> [seed]" writes
+    // scaling.csv for generated scenes of growing size and exits.
+    // "--golden <dir>" checks the reference renders against <dir> and exits
+    // with the number of mismatches; "--golden-update <dir>" rewrites them.
+    // "--serve <socket>" runs the render daemon described above.
+    // "--distribute <workers>" renders the frame on worker processes, which
+    // are started with "--worker <socket>".
+    // "--checkpoint <file>" renders progressively and saves the samples to
+    // <file> periodically; "--resume <file>" continues from such a file.
+    // "--share <name>" publishes completed frames to other processes.
+    // "--y4m <file>" writes completed frames as a Y4M stream; "--frames <n>"
+    // ends the animation after n frames.
+    // "--texture <file.ppm>" puts an image on the ground instead of the checkerboard.
+    // "--stream <file.obj|file.ply>" adds a mesh that is kept on disk and
+    // paged in while rendering (repeatable).
+    std::vector<std::string> args = SplitCommandLine(lpCmdLine);
+    std::vector<TriangleMesh> meshes = MESHES;
+    std::vector<TriangleMesh> loaded_meshes;
+    std::vector<Texture> textures = TEXTURES;
+    std::vector<std::shared_ptr<StreamedMesh>> streamed_meshes;
+    bool wireframe = false;
+    std::string generate_mode;
+    SceneKind generate_kind = SceneKind::SPHERE_GRID;
+    size_t generate_count = 0;
+    uint64_t generate_seed = 1;
+    std::string golden_dir;
+    bool golden_update = false;
+    std::string serve_path;
+    int distribute_workers = 0;
+    std::string worker_path;
+    std::string forwarded_args; // scene-defining arguments repeated for workers
+    std::string checkpoint_path;
+    bool resume = false;
+    SharedFrameRing shared_frames;
+    Y4mWriter y4m;
+    int frame_limit = 0;
+
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--mesh" && i + 1 < args.size()) {
+            TriangleMesh mesh = { {}, {}, {160, 160, 160}, 200, 0.1f }; // grey
+            if (!LoadMesh(args[++i], num_threads, mesh)) {
+                std::string error = "Could not load mesh " + args[i];
+                MessageBoxA(nullptr, error.c_str(), "Error", MB_ICONERROR);
+                return 1;
+            }
+            loaded_meshes.push_back(mesh);
+            meshes.push_back(mesh);
+        }
+        else if (args[i] == "--stream" && i + 1 < args.size()) {
+            auto mesh = std::make_shared<StreamedMesh>();
+            if (!OpenStreamedMesh(args[++i], num_threads, *mesh)) {
+                std::string error = "Could not load mesh " + args[i];
+                MessageBoxA(nullptr, error.c_str(), "Error", MB_ICONERROR);
+                return 1;
+            }
+            streamed_meshes.push_back(mesh);
+        }
+        else if (args[i] == "--wireframe") {
+            wireframe = true;
+        }
+        else if (args[i] == "--texture" && i + 1 < args.size()) {
+            textures[0] = { TextureKind::IMAGE, 1.f, args[++i] };
+            if (OpenTexture(textures[0]) == nullptr) {
+                std::string error = "Could not load texture " + args[i];
+                MessageBoxA(nullptr, error.c_str(), "Error", MB_ICONERROR);
+                return 1;
+            }
+        }
+        else if ((args[i] == "--golden" || args[i] == "--golden-update") && i + 1 < args.size()) {
+            golden_update = args[i] == "--golden-update";
+            golden_dir = args[++i];
+        }
+        else if (args[i] == "--serve" && i + 1 < args.size()) {
+            serve_path = args[++i];
+        }
+        else if (args[i] == "--distribute" && i + 1 < args.size()) {
+            distribute_workers = std::atoi(args[++i].c_str());
+        }
+        else if (args[i] == "--worker" && i + 1 < args.size()) {
+            worker_path = args[++i];
+        }
+        else if ((args[i] == "--checkpoint" || args[i] == "--resume") && i + 1 < args.size()) {
+            resume = args[i] == "--resume";
+            checkpoint_path = args[++i];
+        }
+        else if (args[i] == "--y4m" && i + 1 < args.size()) {
+            if (y4m.thread.joinable()) {
+                MessageBoxA(nullptr, "--y4m may be given only once", "Error", MB_ICONERROR);
+                return 1;
+            }
+            if (!OpenY4m(args[++i], y4m)) {
+                std::string error = "Could not open " + args[i];
+                MessageBoxA(nullptr, error.c_str(), "Error", MB_ICONERROR);
+                return 1;
+            }
+        }
+        else if (args[i] == "--frames" && i + 1 < args.size()) {
+            frame_limit = std::atoi(args[++i].c_str());
+        }
+        else if (args[i] == "--share" && i + 1 < args.size()) {
+            if (!OpenSharedFrameRing(args[++i], shared_frames)) {
+                std::string error = "Could not create shared memory " + args[i];
+                MessageBoxA(nullptr, error.c_str(), "Error", MB_ICONERROR);
+                return 1;
+            }
+        }
+        else if ((args[i] == "--scene" || args[i] == "--scale") && i + 2 < args.size()) {
+            generate_mode = args[i];
+            bool valid = ParseSceneKind(args[i + 1], generate_kind);
+            generate_count = static_cast<size_t>(std::strtod(args[i + 2].c_str(), nullptr));
+            i += 2;
+            if (i + 1 < args.size() && args[i + 1].rfind("--", 0) != 0) {
+                generate_seed = std::strtoull(args[++i].c_str(), nullptr, 10);
+            }
+            if (!valid || generate_count == 0) {
+                MessageBoxA(nullptr, "Expected a scene kind (grid, cloud, clusters, soup, lights) "
+                    "and a primitive count", "Error", MB_ICONERROR);
+                return 1;
+            }
+        }
+    }
+
+    // Only what defines the scene goes to workers: outputs such as --y4m,
+    // --share or --checkpoint belong to the coordinator alone.
+    for (size_t i = 0; i < args.size(); i++) {
+        size_t values = 0;
+        if ((args[i] == "--mesh" || args[i] == "--stream" || args[i] == "--texture") && i + 1 < args.size()) {
+            values = 1;
+        }
+        else if (args[i] == "--scene" && i + 2 < args.size()) {
+            values = i + 3 < args.size() && args[i + 3].rfind("--", 0) != 0 ? 3 : 2;
+        }
+        else {
+            continue;
+        }
+        for (size_t k = i; k <= i + values; k++) {
+            forwarded_args += " \"" + args[k] + "\"";
+        }
+        i += values;
+    }
+
+    if (!serve_path.empty()) {
+        return RunRenderServer(serve_path, threads);
+    }
+    if (!golden_dir.empty()) {
+        return RunGoldenTests(golden_dir, golden_update, threads);
+    }
+    if (generate_mode == "--scale") {
+        return RunScalingReport(generate_kind, generate_count, generate_seed, threads, "scaling.csv") ? 0 : 1;
+    }
+    else if (generate_mode == "--scene") {
+        activeScene = BuildGeneratedScene(GenerateScene(generate_kind, generate_count, generate_seed), loaded_meshes, textures);
+    }
+    else {
+        activeScene = BuildScene(SPHERES, PLANES, BOXES, meshes, GEOMETRY_SETS, INSTANCES, LIGHTS, textures);
+    }
+    for (const std::shared_ptr<StreamedMesh>& mesh : streamed_meshes) {
+        mesh->material = static_cast<int>(activeScene.materials.size());
+        activeScene.materials.push_back({ {160, 160, 160}, 200, 0.1f, -1 }); // grey, as --mesh
+        activeScene.streamed.push_back(mesh);
+    }
+    bool progressive = PROGRESSIVE || !checkpoint_path.empty();
 
     int nSpeed = 2;
     int nSpeedCount = 0;
@@ -361,6 +6087,10 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
         for (int y = -CANVAS_HEIGHT / 2; y < CANVAS_HEIGHT / 2; y++)
             PutPixel(x, y, BACKGROUND_COLOR);
 
+    if (!worker_path.empty()) {
+        return RunTileWorker(worker_path, threads);
+    }
+
     auto start = std::chrono::high_resolution_clock::now(); // Start the timer
 
     /*DrawLine(PointOnCanvas(-200, -100), PointOnCanvas(240, 120), Color(0, 0, 0));
@@ -369,36 +6099,36 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     DrawLine(PointOnCanvas(-50, -50), PointOnCanvas(60, 60), Color(0, 0, 0));
     DrawLine(PointOnCanvas(-150, 100), PointOnCanvas(150, 100), Color(0, 0, 0));*/
 
-    auto p0 = PointOnCanvas(-200, -250);
+    /*auto p0 = PointOnCanvas(-200, -250);
     auto p1 = PointOnCanvas(200, 50);
     auto p2 = PointOnCanvas(20, 250);
 
     DrawFilledTriangle(p0, p1, p2, Color(0, 255, 0));
-    DrawWireframeTriangle(p0, p1, p2, Color(0, 0, 0));
+    DrawWireframeTriangle(p0, p1, p2, Color(0, 0, 0));*/
 
-    /*// Create threads to render sections of the canvas
-    for (unsigned int i = 0; i < num_threads; ++i) {
-        int start_y = i * section_width - CANVAS_HEIGHT / 2;
-        int end_y = (i + 1) * section_width - CANVAS_HEIGHT / 2;
-        if (i == num_threads - 1) {
-            end_y = CANVAS_HEIGHT / 2;
+    if (wireframe) {
+        for (const TriangleMesh& mesh : loaded_meshes) {
+            DrawMeshWireframe(mesh, CAMERA_ROTATION, CAMERA_POSITION, Color(0, 0, 0));
+        }
+    }
+    else if (!progressive) {
+        // Renders locally when the workers could not be set up.
+        if (distribute_workers == 0 || !RenderDistributed(distribute_workers, forwarded_args, threads)) {
+            RenderFrame(threads, activeScene, CAMERA_ROTATION, CAMERA_POSITION, renderGeneration.load());
         }
-
-        threads[i] = std::thread(RenderSection, start_y, end_y,
-            std::cref(SPHERES), std::cref(LIGHTS), std::cref(CAMERA_ROTATION),
-            std::cref(CAMERA_POSITION));
     }
-
-    // Join threads
-    for (auto& thread : threads) {
-        thread.join();
-    }*/
 
     auto end = std::chrono::high_resolution_clock::now(); // Stop the timer
     auto duration = // Calculate the duration in milliseconds
         std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
     std::string time_str = // Convert the duration to a string
         "Time: " + std::to_string(duration.count()) + " milliseconds";
+    if (ADAPTIVE_AA && !progressive && !wireframe) {
+        time_str += ", AA edge pixels: " + std::to_string(aaEdgePixels.load());
+    }
+    if (!activeScene.streamed.empty()) {
+        time_str += ", chunks mapped: " + std::to_string(streamChunkLoads.load());
+    }
 
     // Register the window class
     WNDCLASS wc = {};
@@ -420,63 +6150,169 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
 
     ShowWindow(hwnd, SW_SHOWNORMAL);
 
+    if (progressive && !wireframe) {
+        // The window has to exist before the preview can be presented.
+        ProgressiveStats stats = RenderProgressive(threads, CAMERA_ROTATION, CAMERA_POSITION, hwnd,
+            checkpoint_path, resume);
+        time_str = "Preview: " + std::to_string(stats.preview_ms) + " milliseconds, Time: " +
+            std::to_string(stats.total_ms) + " milliseconds, " +
+            std::to_string(stats.passes) + " passes";
+    }
+
     // Set the time_str as the window text
     SetWindowTextA(hwnd, time_str.c_str());
+    PublishSharedFrame(shared_frames, canvasBuffer);
+    SubmitY4mFrame(y4m, canvasBuffer);
 
-    // Main loop
     MSG msg;
-    while (GetMessage(&msg, nullptr, 0, 0)) {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
-    }
-
-    /*bool running = true;
 
-    while (running) {
-        while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
-            if (msg.message == WM_QUIT) {
-                running = false;
-                break;
-            }
+    if (!ANIMATE || wireframe) {
+        // Main loop
+        while (GetMessage(&msg, nullptr, 0, 0)) {
             TranslateMessage(&msg);
             DispatchMessage(&msg);
         }
+    }
+    else {
+        // Frames run on frame_thread into canvasBuffer while this thread keeps
+        // pumping input, can cancel a frame as soon as its camera is out of
+        // date, and presents the previous frame from front_buffer. A finished
+        // frame is swapped to the front and the next one is started before the
+        // finished one is presented, published and encoded.
+        std::thread frame_thread;
+        std::atomic<bool> frame_finished{ false };
+        HANDLE frame_event = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+        bool frame_completed = false;
+        TemporalStats frame_stats = { 0, 0, false };
+        Vector3 frame_camera = camera_pos;
+        int animation_frame = 0;
+        int frames_completed = 1; // the still frame above
+        bool running = frame_limit <= 0 || frames_completed < frame_limit;
 
-        std::this_thread::sleep_for(10ms);
+        std::vector<DWORD> front_buffer = canvasBuffer;
+        presentedBuffer = &front_buffer;
+        bool present_pending = false;
 
-        // Create threads to render sections of the canvas
-        for (unsigned int i = 0; i < num_threads; ++i) {
-            int start_y = i * section_width - CANVAS_HEIGHT / 2;
-            int end_y = (i + 1) * section_width - CANVAS_HEIGHT / 2;
-            if (i == num_threads - 1) {
-                end_y = CANVAS_HEIGHT / 2;
+        // Pacing: each frame is started so that, at its measured cost, it
+        // finishes one ANIMATION_FRAME_INTERVAL after the previous present.
+        // Frames that cost more than the interval run back to back.
+        std::chrono::duration<double, std::milli> frame_cost(0);
+        std::chrono::duration<double, std::milli> frame_cost_ema(0);
+        auto next_frame_start = std::chrono::steady_clock::now();
+
+        while (running) {
+            while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
+                if (msg.message == WM_QUIT) {
+                    running = false;
+                    break;
+                }
+                TranslateMessage(&msg);
+                DispatchMessage(&msg);
             }
 
-            threads[i] = std::thread(RenderSection, start_y, end_y,
-                std::cref(SPHERES), std::cref(LIGHTS), std::cref(CAMERA_ROTATION),
-                std::cref(camera_pos));
-        }
+            Vector3 target_camera = Add(camera_pos, cameraNudge);
+            bool camera_stale = target_camera.x != frame_camera.x ||
+                target_camera.y != frame_camera.y || target_camera.z != frame_camera.z;
 
-        // Join threads
-        for (auto& thread : threads) {
-            thread.join();
-        }
+            if (frame_thread.joinable() && (camera_stale || !running)) {
+                renderGeneration++;
+            }
+
+            if (frame_thread.joinable() && frame_finished) {
+                frame_thread.join();
+
+                if (frame_completed) {
+                    if (TEMPORAL_REPROJECTION && !ANIMATE_INSTANCES) {
+                        std::string reuse_str = "Reuse: " +
+                            std::to_string(100 * frame_stats.reused / (CANVAS_WIDTH * CANVAS_HEIGHT)) +
+                            "%, traced " + std::to_string(frame_stats.traced) + " pixels";
+                        SetWindowTextA(hwnd, reuse_str.c_str());
+                    }
 
-        nSpeedCount++;
-        bChangePosition = (nSpeedCount == nSpeed);
+                    nSpeedCount++;
+                    bChangePosition = (nSpeedCount == nSpeed);
 
-        if (bChangePosition) {
-            nSpeedCount = 0;
-            camera_pos.x += 0.005f;
-            camera_pos.y += 0.001f;
-            camera_pos.z -= 0.001f;
+                    if (bChangePosition) {
+                        nSpeedCount = 0;
+                        camera_pos.x += 0.005f;
+                        camera_pos.y += 0.001f;
+                        camera_pos.z -= 0.001f;
+                    }
+
+                    std::swap(canvasBuffer, front_buffer);
+                    present_pending = true;
+
+                    frame_cost_ema = frame_cost_ema.count() == 0 ? frame_cost : 0.8 * frame_cost_ema + 0.2 * frame_cost;
+                    next_frame_start = std::chrono::steady_clock::now() +
+                        std::chrono::duration_cast<std::chrono::steady_clock::duration>(ANIMATION_FRAME_INTERVAL - frame_cost_ema);
+
+                    if (frame_limit > 0 && ++frames_completed >= frame_limit) {
+                        running = false;
+                    }
+                }
+            }
+
+            if (running && !frame_thread.joinable() && std::chrono::steady_clock::now() >= next_frame_start) {
+                frame_camera = Add(camera_pos, cameraNudge);
+                frame_finished = false;
+
+                unsigned generation = renderGeneration.load();
+                int frame = animation_frame++;
+                samplingFrame = static_cast<uint32_t>(frame + 1); // 0 is the still frame
+                frame_thread = std::thread([&, generation, frame] {
+                    TraceSetThread(TRACE_FRAME_SLOT);
+                    TRACE_ZONE("FrameJob");
+                    auto frame_start = std::chrono::steady_clock::now();
+                    if (ANIMATE_INSTANCES) {
+                        AnimateInstances(activeScene, frame);
+                        UpdateTopLevel(activeScene, num_threads);
+                    }
+                    if (TEMPORAL_REPROJECTION && !ANIMATE_INSTANCES) {
+                        frame_stats = RenderFrameTemporal(threads, CAMERA_ROTATION, frame_camera, generation);
+                        frame_completed = frame_stats.completed;
+                    }
+                    else {
+                        frame_completed = RenderFrame(threads, activeScene, CAMERA_ROTATION, frame_camera, generation);
+                    }
+                    frame_cost = std::chrono::steady_clock::now() - frame_start;
+                    frame_finished = true;
+                    SetEvent(frame_event);
+                });
+            }
+
+            if (present_pending) {
+                // Overlaps with the frame_thread tracing the next frame.
+                HDC hdc = GetDC(hwnd);
+                UpdateCanvas(hwnd, hdc, CANVAS_WIDTH, CANVAS_HEIGHT);
+                ReleaseDC(hwnd, hdc);
+                PublishSharedFrame(shared_frames, front_buffer);
+                SubmitY4mFrame(y4m, front_buffer);
+                present_pending = false;
+            }
+
+            // Sleep until input arrives, the running frame finishes or the
+            // next frame is due.
+            DWORD timeout = INFINITE;
+            if (!frame_thread.joinable()) {
+                auto wait = std::chrono::ceil<std::chrono::milliseconds>(next_frame_start - std::chrono::steady_clock::now());
+                timeout = wait.count() > 0 ? static_cast<DWORD>(wait.count()) : 0;
+            }
+            if (running) {
+                MsgWaitForMultipleObjects(1, &frame_event, FALSE, timeout, QS_ALLINPUT);
+            }
         }
 
-        // Update canvas
-        HDC hdc = GetDC(hwnd);
-        UpdateCanvas(hwnd, hdc, CANVAS_WIDTH, CANVAS_HEIGHT);
-        ReleaseDC(hwnd, hdc);
-    } */
+        if (frame_thread.joinable()) {
+            frame_thread.join();
+        }
+        CloseHandle(frame_event);
+        presentedBuffer = &canvasBuffer;
+        canvasBuffer = front_buffer;
+    }
+
+    CloseY4m(y4m);
+    CloseSharedFrameRing(shared_frames);
+    TraceDump("trace.json");
 
     return 0;
 }